@@ -0,0 +1,310 @@
+#include "stdafx.h"
+#include "Accelerator.h"
+
+void Accelerator::IntersectBatch(Ray *rays, int count) {
+    for(int i = 0; i < count; i++){
+        Intersect(rays[i]);
+    }
+}
+
+void Accelerator::IntersectTile(Ray *rays, int count) {
+    IntersectBatch(rays, count);
+}
+
+void Accelerator::OccludedBatch(ShadowRay *rays, int count) {
+    for(int i = 0; i < count; i++){
+        rays[i].occluded = Occluded(rays[i].origin, rays[i].direction, rays[i].tmax, rays[i].tnear);
+    }
+}
+
+BVH *Accelerator::Tree() {
+    return nullptr;
+}
+
+float Accelerator::AverageVisitedNodes() const {
+    return -1;
+}
+
+std::unique_ptr<Accelerator> Accelerator::Create(AcceleratorType type, const AcceleratorScene &scene) {
+    switch(type){
+        case AcceleratorType::BVH:
+            return std::make_unique<BVHAccelerator>(scene.triangles);
+        case AcceleratorType::BVHAutoTune:
+            return std::make_unique<BVHAccelerator>(scene.triangles, &scene.camera_rays);
+        case AcceleratorType::BVHScene:
+            return std::make_unique<BVHSceneAccelerator>(scene);
+        case AcceleratorType::KDTree:
+            return std::make_unique<KDTreeAccelerator>(scene.triangles);
+        case AcceleratorType::LazyBVH:
+            return std::make_unique<LazyBVHAccelerator>(scene.triangles);
+        default:
+            return std::make_unique<EmbreeAccelerator>(scene.scene);
+    }
+}
+
+EmbreeAccelerator::EmbreeAccelerator(RTCScene scene) : scene_(scene) {
+}
+
+void EmbreeAccelerator::Intersect(Ray &ray) {
+    RTCIntersectContext context{};
+    rtcInitIntersectContext(&context);
+    rtcIntersect1(scene_, &context, &ray.ray_hit);
+    ResolveHit(ray);
+}
+
+void EmbreeAccelerator::ResolveHit(Ray &ray) const {
+    if(!ray.has_hit()){
+        return;
+    }
+
+    // the attributes are interpolated here once, not again in every getter call
+    const RTCHit &hit = ray.ray_hit.hit;
+    RTCGeometry geometry = rtcGetGeometry(scene_, hit.geomID);
+    Normal3f normal{};
+    Coord2f tex_coord{};
+    rtcInterpolate0(geometry, hit.primID, hit.u, hit.v, RTC_BUFFER_TYPE_VERTEX_ATTRIBUTE, 0, &normal.x, 3);
+    rtcInterpolate0(geometry, hit.primID, hit.u, hit.v, RTC_BUFFER_TYPE_VERTEX_ATTRIBUTE, 1, &tex_coord.u, 2);
+    ray.set_hit(ray.get_tfar(), hit.geomID, hit.primID, hit.u, hit.v, normal, tex_coord,
+                (Material *) rtcGetGeometryUserData(geometry));
+}
+
+#if EMBREE_PACKET_SIZE == 16
+using EmbreeRayHitPacket = RTCRayHit16;
+
+static void IntersectPacket(const int *valid, RTCScene scene, RTCIntersectContext *context, RTCRayHit16 *packet) {
+    rtcIntersect16(valid, scene, context, packet);
+}
+#else
+using EmbreeRayHitPacket = RTCRayHit8;
+
+static void IntersectPacket(const int *valid, RTCScene scene, RTCIntersectContext *context, RTCRayHit8 *packet) {
+    rtcIntersect8(valid, scene, context, packet);
+}
+#endif
+
+void EmbreeAccelerator::IntersectTile(Ray *rays, int count) {
+    // camera rays of a tile are coherent, the flag lets Embree trace the packet together instead of ray by ray
+    RTCIntersectContext context{};
+    rtcInitIntersectContext(&context);
+    context.flags = RTC_INTERSECT_CONTEXT_FLAG_COHERENT;
+
+    for(int first = 0; first < count; first += EMBREE_PACKET_SIZE){
+        const int lanes = count - first < EMBREE_PACKET_SIZE ? count - first : EMBREE_PACKET_SIZE;
+        EmbreeRayHitPacket packet{};
+        // Embree reads the mask with aligned SIMD loads, like the packet
+        alignas(4 * EMBREE_PACKET_SIZE) int valid[EMBREE_PACKET_SIZE];
+        for(int i = 0; i < EMBREE_PACKET_SIZE; i++){
+            valid[i] = i < lanes ? -1 : 0;
+            if(i >= lanes){
+                continue;
+            }
+            const RTCRay &ray = rays[first + i].ray_hit.ray;
+            packet.ray.org_x[i] = ray.org_x;
+            packet.ray.org_y[i] = ray.org_y;
+            packet.ray.org_z[i] = ray.org_z;
+            packet.ray.dir_x[i] = ray.dir_x;
+            packet.ray.dir_y[i] = ray.dir_y;
+            packet.ray.dir_z[i] = ray.dir_z;
+            packet.ray.tnear[i] = ray.tnear;
+            packet.ray.tfar[i] = ray.tfar;
+            packet.ray.time[i] = ray.time;
+            packet.ray.mask[i] = ray.mask;
+            packet.ray.id[i] = ray.id;
+            packet.ray.flags[i] = ray.flags;
+            packet.hit.geomID[i] = RTC_INVALID_GEOMETRY_ID;
+            packet.hit.instID[0][i] = RTC_INVALID_GEOMETRY_ID;
+        }
+
+        IntersectPacket(valid, scene_, &context, &packet);
+
+        for(int i = 0; i < lanes; i++){
+            Ray &ray = rays[first + i];
+            ray.ray_hit.ray.tfar = packet.ray.tfar[i];
+            RTCHit &hit = ray.ray_hit.hit;
+            hit.Ng_x = packet.hit.Ng_x[i];
+            hit.Ng_y = packet.hit.Ng_y[i];
+            hit.Ng_z = packet.hit.Ng_z[i];
+            hit.u = packet.hit.u[i];
+            hit.v = packet.hit.v[i];
+            hit.primID = packet.hit.primID[i];
+            hit.geomID = packet.hit.geomID[i];
+            ResolveHit(ray);
+        }
+    }
+}
+
+void EmbreeAccelerator::IntersectBatch(Ray *rays, int count) {
+    if(count == 0){
+        return;
+    }
+
+    // RTCRayHit leads every Ray, so the stream is the array itself with the Ray size as stride, nothing is copied
+    RTCIntersectContext context{};
+    rtcInitIntersectContext(&context);
+    context.flags = RTC_INTERSECT_CONTEXT_FLAG_INCOHERENT;
+    rtcIntersect1M(scene_, &context, &rays[0].ray_hit, (unsigned int) count, sizeof(Ray));
+    for(int i = 0; i < count; i++){
+        ResolveHit(rays[i]);
+    }
+}
+
+bool EmbreeAccelerator::Occluded(const Vector3 &origin, const Vector3 &direction, float tmax, float tnear) {
+    // any hit only, Embree sets tfar to -inf once something blocks the ray and touches no hit attributes
+    RTCIntersectContext context{};
+    rtcInitIntersectContext(&context);
+    RTCRay ray{};
+    ray.org_x = origin.x;
+    ray.org_y = origin.y;
+    ray.org_z = origin.z;
+    ray.dir_x = direction.x;
+    ray.dir_y = direction.y;
+    ray.dir_z = direction.z;
+    ray.tnear = tnear;
+    ray.tfar = tmax;
+    ray.mask = 0xFFFFFFFF;
+    rtcOccluded1(scene_, &context, &ray);
+    return ray.tfar < 0.0f;
+}
+
+void EmbreeAccelerator::OccludedBatch(ShadowRay *rays, int count) {
+    // streams of EMBREE_STREAM_SIZE rays, Embree regroups them into packets itself
+    RTCIntersectContext context{};
+    rtcInitIntersectContext(&context);
+    RTCRay stream[EMBREE_STREAM_SIZE];
+    for(int first = 0; first < count; first += EMBREE_STREAM_SIZE){
+        const int size = count - first < EMBREE_STREAM_SIZE ? count - first : EMBREE_STREAM_SIZE;
+        for(int i = 0; i < size; i++){
+            const ShadowRay &ray = rays[first + i];
+            RTCRay &stream_ray = stream[i];
+            stream_ray = RTCRay{};
+            stream_ray.org_x = ray.origin.x;
+            stream_ray.org_y = ray.origin.y;
+            stream_ray.org_z = ray.origin.z;
+            stream_ray.dir_x = ray.direction.x;
+            stream_ray.dir_y = ray.direction.y;
+            stream_ray.dir_z = ray.direction.z;
+            stream_ray.tnear = ray.tnear;
+            stream_ray.tfar = ray.tmax;
+            stream_ray.mask = 0xFFFFFFFF;
+        }
+        rtcOccluded1M(scene_, &context, stream, size, sizeof(RTCRay));
+        for(int i = 0; i < size; i++){
+            rays[first + i].occluded = stream[i].tfar < 0.0f;
+        }
+    }
+}
+
+const char *EmbreeAccelerator::Name() const {
+    return "Embree";
+}
+
+BVHAccelerator::BVHAccelerator(const std::vector<std::shared_ptr<BVHTriangle>> &triangles,
+                               const std::vector<Ray> *tune_rays)
+        : bvh_(std::make_unique<BVH>(triangles)) {
+    if(tune_rays){
+        bvh_->AutoTune(*tune_rays);
+    }
+    else{
+        bvh_->BuildTree();
+    }
+    BVHReport report = bvh_->Report();
+    report.rays_per_second = bvh_->RaysPerSecond();
+    report.Print();
+}
+
+void BVHAccelerator::Intersect(Ray &ray) {
+    bvh_->Traverse(ray);
+}
+
+bool BVHAccelerator::Occluded(const Vector3 &origin, const Vector3 &direction, float tmax, float tnear) {
+    return bvh_->Occluded(origin, direction, tmax, tnear);
+}
+
+void BVHAccelerator::IntersectBatch(Ray *rays, int count) {
+    bvh_->TraverseBatch(rays, count);
+}
+
+void BVHAccelerator::IntersectTile(Ray *rays, int count) {
+    bvh_->TraverseBeam(rays, count);
+}
+
+const char *BVHAccelerator::Name() const {
+    return "BVH";
+}
+
+BVH *BVHAccelerator::Tree() {
+    return bvh_.get();
+}
+
+float BVHAccelerator::AverageVisitedNodes() const {
+    return bvh_->AverageVisitedNodes();
+}
+
+BVHSceneAccelerator::BVHSceneAccelerator(const AcceleratorScene &scene) {
+    // OBJ files carry no instancing, so every Surface gets its own tree placed with identity
+    BVHSettings settings;
+    settings.verbose = false;
+    for(size_t i = 0; i < scene.surface_offsets.size(); i++){
+        const int from = scene.surface_offsets[i];
+        const int to = i + 1 < scene.surface_offsets.size() ? scene.surface_offsets[i + 1]
+                                                            : (int) scene.triangles.size();
+        auto blas = std::make_shared<BVH>(std::vector<std::shared_ptr<BVHTriangle>>(
+                scene.triangles.begin() + from, scene.triangles.begin() + to), settings);
+        blas->BuildTree();
+        bvh_scene_.AddInstance(blas);
+    }
+    bvh_scene_.BuildTree();
+}
+
+void BVHSceneAccelerator::Intersect(Ray &ray) {
+    bvh_scene_.Traverse(ray);
+}
+
+bool BVHSceneAccelerator::Occluded(const Vector3 &origin, const Vector3 &direction, float tmax, float tnear) {
+    return bvh_scene_.Occluded(origin, direction, tmax, tnear);
+}
+
+const char *BVHSceneAccelerator::Name() const {
+    return "BVH scene";
+}
+
+KDTreeAccelerator::KDTreeAccelerator(const std::vector<std::shared_ptr<BVHTriangle>> &triangles)
+        : kd_tree_(std::make_unique<KDTree>(triangles)) {
+    kd_tree_->BuildTree();
+    KDReport report = kd_tree_->Report();
+    report.rays_per_second = kd_tree_->RaysPerSecond();
+    report.Print();
+}
+
+void KDTreeAccelerator::Intersect(Ray &ray) {
+    kd_tree_->Traverse(ray);
+}
+
+bool KDTreeAccelerator::Occluded(const Vector3 &origin, const Vector3 &direction, float tmax, float tnear) {
+    return kd_tree_->Occluded(origin, direction, tmax, tnear);
+}
+
+const char *KDTreeAccelerator::Name() const {
+    return "k-d tree";
+}
+
+float KDTreeAccelerator::AverageVisitedNodes() const {
+    return kd_tree_->AverageVisitedNodes();
+}
+
+LazyBVHAccelerator::LazyBVHAccelerator(const std::vector<std::shared_ptr<BVHTriangle>> &triangles)
+        : lazy_bvh_(std::make_unique<LazyBVH>(triangles)) {
+    lazy_bvh_->BuildTree();
+}
+
+void LazyBVHAccelerator::Intersect(Ray &ray) {
+    lazy_bvh_->Traverse(ray);
+}
+
+bool LazyBVHAccelerator::Occluded(const Vector3 &origin, const Vector3 &direction, float tmax, float tnear) {
+    return lazy_bvh_->Occluded(origin, direction, tmax, tnear);
+}
+
+const char *LazyBVHAccelerator::Name() const {
+    return "lazy BVH";
+}
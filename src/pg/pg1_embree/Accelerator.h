@@ -0,0 +1,156 @@
+#ifndef PG1_ACCELERATOR_H
+#define PG1_ACCELERATOR_H
+
+#include "ray.h"
+#include "BVH.h"
+#include "BVHScene.h"
+#include "KDTree.h"
+#include "LazyBVH.h"
+#include "embree3/rtcore.h"
+#include <vector>
+#include <memory>
+
+/*! \def EMBREE_PACKET_SIZE
+\brief Camera rays per rtcIntersect packet of EmbreeAccelerator::IntersectTile, 16 with AVX-512 and 8 otherwise.
+*/
+#if defined(__AVX512F__)
+#define EMBREE_PACKET_SIZE 16
+#else
+#define EMBREE_PACKET_SIZE 8
+#endif
+
+/*! \def EMBREE_STREAM_SIZE
+\brief Shadow rays per rtcOccluded1M call of EmbreeAccelerator::OccludedBatch, copied into a stack array first.
+*/
+#define EMBREE_STREAM_SIZE 64
+
+enum class AcceleratorType{
+    Embree = 0,         // committed Embree scene
+    BVH = 1,            // one flat BVH over all triangles
+    BVHScene = 2,       // bottom-level BVH per Surface under a top-level BVHScene
+    KDTree = 3,         // SAH k-d tree over all triangles, for comparison with the BVH
+    BVHAutoTune = 4,    // flat BVH with the split method, leaf size and width that traced a sample of rays fastest
+    LazyBVH = 5,        // top levels of a BVH, the subtrees are built when the first ray reaches them
+};
+
+// geometry filled in by LoadScene, every backend is built from the same data
+struct AcceleratorScene{
+    RTCScene scene = nullptr;                               // committed, owned by the renderer
+    std::vector<std::shared_ptr<BVHTriangle>> triangles;
+    std::vector<int> surface_offsets;                       // first triangle of every Surface
+    std::vector<Ray> camera_rays;                           // coarse pixel grid, BVHAutoTune times its candidates on it
+};
+
+// one visibility query of OccludedBatch
+struct ShadowRay{
+    Vector3 origin;
+    Vector3 direction;
+    float tmax;
+    float tnear = 0.001f;
+    bool occluded = false;      // written by the query
+};
+
+// ray queries of one backend, the renderers only talk to this
+class Accelerator{
+public:
+    virtual ~Accelerator() = default;
+
+    // closest hit, resolved into the ray so the Ray getters work the same for every backend
+    virtual void Intersect(Ray &ray) = 0;
+    virtual bool Occluded(const Vector3 &origin, const Vector3 &direction, float tmax, float tnear = 0.001f) = 0;
+    virtual void OccludedBatch(ShadowRay *rays, int count);
+    virtual void IntersectBatch(Ray *rays, int count);
+
+    // camera rays of one image tile, the samples of a pixel next to each other
+    virtual void IntersectTile(Ray *rays, int count);
+
+    virtual const char *Name() const = 0;
+
+    // flat tree for the statistics in the Ui, nullptr for backends without one
+    virtual BVH *Tree();
+
+    // nodes per ray counted with BVH::COLLECT_STATS, negative for backends that do not count them
+    virtual float AverageVisitedNodes() const;
+
+    static std::unique_ptr<Accelerator> Create(AcceleratorType type, const AcceleratorScene &scene);
+};
+
+class EmbreeAccelerator : public Accelerator{
+public:
+    explicit EmbreeAccelerator(RTCScene scene);
+
+    void Intersect(Ray &ray) override;
+    bool Occluded(const Vector3 &origin, const Vector3 &direction, float tmax, float tnear) override;
+    void OccludedBatch(ShadowRay *rays, int count) override;
+
+    // the rays go to rtcIntersect1M in place as one incoherent stream
+    void IntersectBatch(Ray *rays, int count) override;
+
+    // packets of EMBREE_PACKET_SIZE rays traced with the coherent context flag
+    void IntersectTile(Ray *rays, int count) override;
+    const char *Name() const override;
+
+private:
+    RTCScene scene_;
+
+    // normal, texture coordinates and material of a hit found by Embree
+    void ResolveHit(Ray &ray) const;
+};
+
+class BVHAccelerator : public Accelerator{
+public:
+    // with tune_rays the tree is picked by BVH::AutoTune instead of built with the default settings
+    explicit BVHAccelerator(const std::vector<std::shared_ptr<BVHTriangle>> &triangles,
+                            const std::vector<Ray> *tune_rays = nullptr);
+
+    void Intersect(Ray &ray) override;
+    bool Occluded(const Vector3 &origin, const Vector3 &direction, float tmax, float tnear) override;
+    void IntersectBatch(Ray *rays, int count) override;
+    void IntersectTile(Ray *rays, int count) override;
+    const char *Name() const override;
+    BVH *Tree() override;
+    float AverageVisitedNodes() const override;
+
+private:
+    std::unique_ptr<BVH> bvh_;
+};
+
+class BVHSceneAccelerator : public Accelerator{
+public:
+    explicit BVHSceneAccelerator(const AcceleratorScene &scene);
+
+    void Intersect(Ray &ray) override;
+    bool Occluded(const Vector3 &origin, const Vector3 &direction, float tmax, float tnear) override;
+    const char *Name() const override;
+
+private:
+    BVHScene bvh_scene_;
+};
+
+class KDTreeAccelerator : public Accelerator{
+public:
+    explicit KDTreeAccelerator(const std::vector<std::shared_ptr<BVHTriangle>> &triangles);
+
+    void Intersect(Ray &ray) override;
+    bool Occluded(const Vector3 &origin, const Vector3 &direction, float tmax, float tnear) override;
+    const char *Name() const override;
+    float AverageVisitedNodes() const override;
+
+private:
+    std::unique_ptr<KDTree> kd_tree_;
+};
+
+class LazyBVHAccelerator : public Accelerator{
+public:
+    explicit LazyBVHAccelerator(const std::vector<std::shared_ptr<BVHTriangle>> &triangles);
+
+    void Intersect(Ray &ray) override;
+    bool Occluded(const Vector3 &origin, const Vector3 &direction, float tmax, float tnear) override;
+    const char *Name() const override;
+
+private:
+    std::unique_ptr<LazyBVH> lazy_bvh_;
+};
+
+
+#endif //PG1_ACCELERATOR_H
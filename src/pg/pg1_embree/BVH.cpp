@@ -4,85 +4,836 @@
 #include "stdafx.h"
 #include "BVH.h"
 
+#include <algorithm>
 #include <utility>
+#include <iostream>
+#include <chrono>
+#include <immintrin.h>
 
-BVH::BVH(std::vector<std::shared_ptr<BVHTriangle>> items) {
+bool BVH::COLLECT_STATS = false;
+
+BVH::BVH(std::vector<std::shared_ptr<BVHTriangle>> items, BVHSettings settings) {
     items_ = std::move(items);
-    max_leaf_items_ = 4;
+    settings_ = settings;
+}
+
+void BVH::SetSplitMethod(BVHSplitMethod split_method) {
+    settings_.split_method = split_method;
+}
+
+void BVH::SetWidth(int width) {
+    settings_.width = width;
+    if(!nodes_.empty()){
+        BuildWideNodes();
+    }
+}
+
+void BVH::SetQuantized(bool quantized) {
+    settings_.quantized = quantized;
+    if(!nodes_.empty()){
+        BuildWideNodes();
+    }
 }
 
 void BVH::BuildTree() {
-    root_ = BuildTree(0, items_.size(), 0);
+    const int count = (int) items_.size();
+    nodes_.clear();
+    leaf_items_.clear();
+    if(count == 0){
+        root_ = nullptr;
+        return;
+    }
+
+    auto t0 = std::chrono::high_resolution_clock::now();
+
+    // bounds and centroids are computed once, the builders only shuffle prim_indices_
+    prim_bounds_.resize(count);
+    prim_centroids_.resize(count);
+    prim_items_.resize(count);
+    prim_indices_.resize(count);
+#pragma omp parallel for
+    for(int i = 0; i < count; i++){
+        prim_bounds_[i] = items_[i]->get_bbox();
+        prim_centroids_[i] = prim_bounds_[i].get_center();
+        prim_items_[i] = i;
+        prim_indices_[i] = i;
+    }
+
+    if(settings_.split_method == BVHSplitMethod::LBVH){
+        SortByMortonCodes();
+    }
+
+    if(settings_.split_method == BVHSplitMethod::SBVH){
+        // the number of references grows during the build, leaves append theirs to prim_indices_
+        std::vector<int> refs;
+        refs.swap(prim_indices_);
+        BVHBbox bounds = BVHBbox::empty();
+        for(const BVHBbox &prim_bounds : prim_bounds_){
+            bounds.grow(prim_bounds);
+        }
+        root_ = BuildSpatialTree(refs, bounds.surface_area(), 0);
+    }
+    else{
+        // large subtrees spawn tasks, the top levels run on one thread until there is enough work to share
+#pragma omp parallel
+#pragma omp single
+        root_ = BuildTree(0, count, 0);
+    }
+
+    // compile the pointer tree into one depth-first array and let the shared_ptr nodes go
+    const int references = (int) prim_indices_.size();
+    nodes_.reserve(2 * references);
+    FlattenTree(root_);
+    root_ = nullptr;
+    BuildWideNodes();
+
+    // leaves span index ranges in the order the builder left the references, items_ stays as it was given
+    leaf_items_.resize(references);
+    for(int i = 0; i < references; i++){
+        leaf_items_[i] = prim_items_[prim_indices_[i]];
+    }
+    BuildTriangleBuffer();
+
+    prim_bounds_.clear();
+    prim_centroids_.clear();
+    prim_items_.clear();
+    prim_indices_.clear();
+    prim_morton_.clear();
+
+    std::chrono::duration<float> duration = std::chrono::high_resolution_clock::now() - t0;
+    build_time_ = duration.count();
+    build_sah_cost_ = SAHCost();
+    if(settings_.verbose){
+        std::cout << "BVH " << SplitMethodName(settings_.split_method) << " built in " << build_time_ << " seconds, "
+                  << nodes_.size() << " nodes, ";
+        if(references > count){
+            std::cout << references << " references to " << count << " triangles, ";
+        }
+        std::cout << "SAH cost " << build_sah_cost_ << ", " << NodeBytesPerTriangle() << " node bytes/triangle"
+                  << std::endl;
+    }
+
+    if(settings_.optimize_seconds > 0){
+        Optimize(settings_.optimize_seconds);
+    }
+}
+
+bool BVH::Refit() {
+    if(nodes_.empty()){
+        return false;
+    }
+
+    // the leaf order stays, so only the vertex data has to be read again
+    const int count = (int) items_.size();
+#pragma omp parallel for
+    for(int i = 0; i < count; i++){
+        items_[i]->calculate_bbox();
+        items_[i]->calculate_area();
+    }
+    BuildTriangleBuffer();
+
+    // children always follow their parent in the depth-first array, so a reverse sweep is bottom-up
+    for(int i = (int) nodes_.size() - 1; i >= 0; i--){
+        BVHFlatNode &node = nodes_[i];
+        node.bbox = BVHBbox::empty();
+        if(node.is_leaf()){
+            for(int j = node.offset; j < node.offset + node.count; j++){
+                node.bbox.grow(items_[leaf_items_[j]]->get_bbox());
+            }
+        }
+        else{
+            node.bbox.grow(nodes_[i + 1].bbox);
+            node.bbox.grow(nodes_[node.offset].bbox);
+        }
+    }
+
+    float cost = SAHCost();
+    if(cost > build_sah_cost_ * settings_.rebuild_threshold){
+        if(settings_.verbose){
+            std::cout << "BVH SAH cost degraded from " << build_sah_cost_ << " to " << cost << ", rebuilding"
+                      << std::endl;
+        }
+        BuildTree();
+        return true;
+    }
+
+    BuildWideNodes();
+    return false;
+}
+
+float BVH::BuildTime() const {
+    return build_time_;
+}
+
+const char *BVH::SplitMethodName(BVHSplitMethod split_method) {
+    switch(split_method){
+        case BVHSplitMethod::Median: return "median";
+        case BVHSplitMethod::SAH: return "SAH";
+        case BVHSplitMethod::LBVH: return "LBVH";
+        case BVHSplitMethod::SBVH: return "SBVH";
+    }
+    return "unknown";
+}
+
+void BVH::BuildTriangleBuffer() {
+    const int count = (int) leaf_items_.size();
+    triangles_.resize(count);
+    vertices_.resize(3 * count);
+    materials_.resize(count);
+    geom_ids_.resize(count);
+
+    for(int i = 0; i < count; i++){
+        const BVHTriangle &triangle = *items_[leaf_items_[i]];
+        triangles_.set(i, triangle.vertices_[0].position, triangle.vertices_[1].position,
+                       triangle.vertices_[2].position);
+        vertices_[3 * i] = triangle.vertices_[0];
+        vertices_[3 * i + 1] = triangle.vertices_[1];
+        vertices_[3 * i + 2] = triangle.vertices_[2];
+        materials_[i] = triangle.material;
+        geom_ids_[i] = triangle.geom_id;
+    }
 }
 
 void BVH::Traverse(Ray &ray) {
-    Traverse(ray, root_, 0);
+    BVHHitPoint hit;
+    hit.tfar = ray.get_tfar();
+    Intersect(BVHRay(ray), hit);
+    ResolveHit(hit);
+    hit.store(ray);
+}
+
+bool BVH::Occluded(const Vector3 &origin, const Vector3 &direction, float tmax, float tnear) {
+    return Occluded(BVHRay(origin, direction, tnear), tmax);
+}
+
+bool BVH::Occluded(const BVHRay &ray, float tmax) {
+    BVHHitPoint hit;
+    hit.tfar = tmax;
+
+    if(settings_.width == 4 && !nodes4_.empty()){
+        return TraverseWide<BVH4Node, true>(ray, hit, nodes4_);
+    }
+    if(settings_.width == 8 && !nodes8_.empty()){
+        return TraverseWide<BVH8Node, true>(ray, hit, nodes8_);
+    }
+    if(settings_.width == 4 && !nodes4q_.empty()){
+        return TraverseWide<BVH4QNode, true>(ray, hit, nodes4q_);
+    }
+    if(settings_.width == 8 && !nodes8q_.empty()){
+        return TraverseWide<BVH8QNode, true>(ray, hit, nodes8q_);
+    }
+    if(!nodes_.empty()){
+        return TraverseBinary<true>(ray, hit);
+    }
+    return false;
+}
+
+BVHBbox BVH::Bounds() const {
+    return nodes_.empty() ? BVHBbox::empty() : nodes_[0].bbox;
+}
+
+void BVH::Intersect(const BVHRay &ray, BVHHitPoint &hit) {
+    if(settings_.width == 4 && !nodes4_.empty()){
+        TraverseWide<BVH4Node, false>(ray, hit, nodes4_);
+    }
+    else if(settings_.width == 8 && !nodes8_.empty()){
+        TraverseWide<BVH8Node, false>(ray, hit, nodes8_);
+    }
+    else if(settings_.width == 4 && !nodes4q_.empty()){
+        TraverseWide<BVH4QNode, false>(ray, hit, nodes4q_);
+    }
+    else if(settings_.width == 8 && !nodes8q_.empty()){
+        TraverseWide<BVH8QNode, false>(ray, hit, nodes8q_);
+    }
+    else if(!nodes_.empty()){
+        TraverseBinary<false>(ray, hit);
+    }
+}
+
+static int IntersectTriangles4(const BVHTriangleBuffer &t, int i, const BVHRay &ray, float tfar,
+                               float *dist, float *u, float *v) {
+    // Moller-Trumbore algorithm for 4 neighbouring triangles, returns the lanes hit in (tnear, tfar)
+    const __m128 epsilon = _mm_set1_ps(0.00001f);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 dx = _mm_set1_ps(ray.direction.x), dy = _mm_set1_ps(ray.direction.y);
+    const __m128 dz = _mm_set1_ps(ray.direction.z);
+    const __m128 e1x = _mm_loadu_ps(&t.e1_x[i]), e1y = _mm_loadu_ps(&t.e1_y[i]), e1z = _mm_loadu_ps(&t.e1_z[i]);
+    const __m128 e2x = _mm_loadu_ps(&t.e2_x[i]), e2y = _mm_loadu_ps(&t.e2_y[i]), e2z = _mm_loadu_ps(&t.e2_z[i]);
+
+    const __m128 hx = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+    const __m128 hy = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+    const __m128 hz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+    const __m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, hx), _mm_mul_ps(e1y, hy)), _mm_mul_ps(e1z, hz));
+    const __m128 f = _mm_div_ps(one, a);
+
+    const __m128 sx = _mm_sub_ps(_mm_set1_ps(ray.origin.x), _mm_loadu_ps(&t.v0_x[i]));
+    const __m128 sy = _mm_sub_ps(_mm_set1_ps(ray.origin.y), _mm_loadu_ps(&t.v0_y[i]));
+    const __m128 sz = _mm_sub_ps(_mm_set1_ps(ray.origin.z), _mm_loadu_ps(&t.v0_z[i]));
+    const __m128 uu = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, hx), _mm_mul_ps(sy, hy)), _mm_mul_ps(sz, hz)));
+
+    const __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+    const __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+    const __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+    const __m128 vv = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)));
+    const __m128 tt = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)),
+                                               _mm_mul_ps(e2z, qz)));
+
+    __m128 valid = _mm_or_ps(_mm_cmple_ps(a, _mm_sub_ps(zero, epsilon)), _mm_cmpge_ps(a, epsilon));
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(uu, zero), _mm_cmple_ps(uu, one)));
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(vv, zero), _mm_cmple_ps(_mm_add_ps(uu, vv), one)));
+    valid = _mm_and_ps(valid, _mm_cmpgt_ps(tt, _mm_set1_ps(ray.tnear)));
+    valid = _mm_and_ps(valid, _mm_cmplt_ps(tt, _mm_set1_ps(tfar)));
+
+    _mm_storeu_ps(dist, tt);
+    _mm_storeu_ps(u, uu);
+    _mm_storeu_ps(v, vv);
+    return _mm_movemask_ps(valid);
+}
+
+static int IntersectTriangles8(const BVHTriangleBuffer &t, int i, const BVHRay &ray, float tfar,
+                               float *dist, float *u, float *v) {
+#if defined(__AVX__)
+    const __m256 epsilon = _mm256_set1_ps(0.00001f);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 dx = _mm256_set1_ps(ray.direction.x), dy = _mm256_set1_ps(ray.direction.y);
+    const __m256 dz = _mm256_set1_ps(ray.direction.z);
+    const __m256 e1x = _mm256_loadu_ps(&t.e1_x[i]), e1y = _mm256_loadu_ps(&t.e1_y[i]);
+    const __m256 e1z = _mm256_loadu_ps(&t.e1_z[i]);
+    const __m256 e2x = _mm256_loadu_ps(&t.e2_x[i]), e2y = _mm256_loadu_ps(&t.e2_y[i]);
+    const __m256 e2z = _mm256_loadu_ps(&t.e2_z[i]);
+
+    const __m256 hx = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+    const __m256 hy = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+    const __m256 hz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+    const __m256 a = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, hx), _mm256_mul_ps(e1y, hy)),
+                                   _mm256_mul_ps(e1z, hz));
+    const __m256 f = _mm256_div_ps(one, a);
+
+    const __m256 sx = _mm256_sub_ps(_mm256_set1_ps(ray.origin.x), _mm256_loadu_ps(&t.v0_x[i]));
+    const __m256 sy = _mm256_sub_ps(_mm256_set1_ps(ray.origin.y), _mm256_loadu_ps(&t.v0_y[i]));
+    const __m256 sz = _mm256_sub_ps(_mm256_set1_ps(ray.origin.z), _mm256_loadu_ps(&t.v0_z[i]));
+    const __m256 uu = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, hx), _mm256_mul_ps(sy, hy)),
+                                                     _mm256_mul_ps(sz, hz)));
+
+    const __m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+    const __m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+    const __m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+    const __m256 vv = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)),
+                                                     _mm256_mul_ps(dz, qz)));
+    const __m256 tt = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)),
+                                                     _mm256_mul_ps(e2z, qz)));
+
+    __m256 valid = _mm256_or_ps(_mm256_cmp_ps(a, _mm256_sub_ps(zero, epsilon), _CMP_LE_OQ),
+                                _mm256_cmp_ps(a, epsilon, _CMP_GE_OQ));
+    valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(uu, zero, _CMP_GE_OQ),
+                                               _mm256_cmp_ps(uu, one, _CMP_LE_OQ)));
+    valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(vv, zero, _CMP_GE_OQ),
+                                               _mm256_cmp_ps(_mm256_add_ps(uu, vv), one, _CMP_LE_OQ)));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(tt, _mm256_set1_ps(ray.tnear), _CMP_GT_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(tt, _mm256_set1_ps(tfar), _CMP_LT_OQ));
+
+    _mm256_storeu_ps(dist, tt);
+    _mm256_storeu_ps(u, uu);
+    _mm256_storeu_ps(v, vv);
+    return _mm256_movemask_ps(valid);
+#else
+    // without AVX the 8 triangles go through the SSE kernel in two halves
+    int low = IntersectTriangles4(t, i, ray, tfar, dist, u, v);
+    int high = IntersectTriangles4(t, i + 4, ray, tfar, dist + 4, u + 4, v + 4);
+    return low | (high << 4);
+#endif
+}
+
+template <bool ANY_HIT>
+bool BVH::IntersectLeaf(int from, int count, const BVHRay &ray, BVHHitPoint &hit) const {
+    // only t, u, v and the triangle index are written, the rest waits for ResolveHit
+    if(count == 1){
+        float dist, u, v;
+        if(triangles_.intersect(from, ray, dist, u, v) && dist > ray.tnear && dist < hit.tfar){
+            if(!ANY_HIT){
+                hit.tfar = dist;
+                hit.u = u;
+                hit.v = v;
+                hit.prim_id = from;
+            }
+            return true;
+        }
+        return false;
+    }
+
+    // the leaf triangles are neighbours in the buffer, one SIMD test covers a whole group of them
+    bool found = false;
+    float dist[BVH_LEAF_GROUP], u[BVH_LEAF_GROUP], v[BVH_LEAF_GROUP];
+    for(int i = from; i < from + count; i += BVH_LEAF_GROUP){
+        int lanes = BVH_LEAF_GROUP == 8 ? IntersectTriangles8(triangles_, i, ray, hit.tfar, dist, u, v)
+                                        : IntersectTriangles4(triangles_, i, ray, hit.tfar, dist, u, v);
+
+        // lanes past the leaf belong to the next leaf or to the padding
+        if(from + count - i < BVH_LEAF_GROUP){
+            lanes &= (1 << (from + count - i)) - 1;
+        }
+        if(lanes == 0){
+            continue;
+        }
+        if(ANY_HIT){
+            return true;
+        }
+
+        for(int k = 0; k < BVH_LEAF_GROUP; k++){
+            if((lanes & (1 << k)) && dist[k] < hit.tfar){
+                hit.tfar = dist[k];
+                hit.u = u[k];
+                hit.v = v[k];
+                hit.prim_id = i + k;
+                found = true;
+            }
+        }
+    }
+    return found;
+}
+
+template bool BVH::IntersectLeaf<false>(int from, int count, const BVHRay &ray, BVHHitPoint &hit) const;
+template bool BVH::IntersectLeaf<true>(int from, int count, const BVHRay &ray, BVHHitPoint &hit) const;
+
+void BVH::ResolveHit(BVHHitPoint &hit) const {
+    // interpolation runs once for the closest hit, not for every closer candidate
+    if(hit.prim_id < 0){
+        return;
+    }
+
+    const Vertex *v = &vertices_[3 * hit.prim_id];
+    const float w = 1 - hit.u - hit.v;
+    hit.normal = v[0].normal * w + v[1].normal * hit.u + v[2].normal * hit.v;
+    hit.text_coords.u = v[0].texture_coords[0].u * w + v[1].texture_coords[0].u * hit.u
+                        + v[2].texture_coords[0].u * hit.v;
+    hit.text_coords.v = v[0].texture_coords[0].v * w + v[1].texture_coords[0].v * hit.u
+                        + v[2].texture_coords[0].v * hit.v;
+    hit.material = materials_[hit.prim_id];
+    hit.geom_id = geom_ids_[hit.prim_id];
+    hit.is_intersected = true;
+}
+
+void BVHHitPoint::store(Ray &ray) const {
+    if(is_intersected){
+        ray.set_hit(tfar, geom_id, (unsigned int) prim_id, u, v, normal, text_coords, material);
+    }
+}
+
+template <bool ANY_HIT>
+bool BVH::TraverseBinary(const BVHRay &ray, BVHHitPoint &hit, int root) {
+    int visited = 0;
+
+    // far children wait on the stack together with their entry distance
+    int stack[BVH_STACK_SIZE];
+    float stack_tmin[BVH_STACK_SIZE];
+    int stack_size = 0;
+
+    float tmin;
+    int node_index = nodes_[root].bbox.is_intersecting(ray, hit.tfar, tmin) ? root : -1;
+
+    while(node_index >= 0){
+        const int current = node_index;
+        const BVHFlatNode &node = nodes_[current];
+        visited++;
+        node_index = -1;
+
+        if(node.is_leaf()){
+            if(IntersectLeaf<ANY_HIT>(node.offset, node.count, ray, hit) && ANY_HIT){
+                RecordStats(hit, visited, root == 0);
+                return true;
+            }
+        } else {
+            int near_index = current + 1;
+            int far_index = node.offset;
+            float t_near, t_far;
+            bool hit_near = nodes_[near_index].bbox.is_intersecting(ray, hit.tfar, t_near);
+            bool hit_far = nodes_[far_index].bbox.is_intersecting(ray, hit.tfar, t_far);
+
+            if(hit_near && hit_far){
+                if(t_far < t_near){
+                    std::swap(near_index, far_index);
+                    std::swap(t_near, t_far);
+                }
+                stack[stack_size] = far_index;
+                stack_tmin[stack_size] = t_far;
+                stack_size++;
+                node_index = near_index;
+            }
+            else if(hit_near){
+                node_index = near_index;
+            }
+            else if(hit_far){
+                node_index = far_index;
+            }
+        }
+
+        // pop the next node that can still hold a closer hit
+        while(node_index < 0 && stack_size > 0){
+            stack_size--;
+            if(stack_tmin[stack_size] <= hit.tfar){
+                node_index = stack[stack_size];
+            }
+        }
+    }
+
+    RecordStats(hit, visited, root == 0);
+    return hit.prim_id >= 0;
+}
+
+template bool BVH::TraverseBinary<false>(const BVHRay &ray, BVHHitPoint &hit, int root);
+template bool BVH::TraverseBinary<true>(const BVHRay &ray, BVHHitPoint &hit, int root);
+
+void BVH::RecordStats(BVHHitPoint &hit, int visited, bool new_ray) {
+    hit.visited_nodes += visited;
+    if(COLLECT_STATS){
+        if(new_ray){
+            stats_rays_.fetch_add(1, std::memory_order_relaxed);
+        }
+        stats_nodes_.fetch_add(visited, std::memory_order_relaxed);
+    }
+}
+
+float BVH::AverageVisitedNodes() const {
+    long long rays = stats_rays_.load(std::memory_order_relaxed);
+    if(rays == 0){
+        return 0;
+    }
+    return (float) stats_nodes_.load(std::memory_order_relaxed) / (float) rays;
+}
+
+void BVH::ResetStats() {
+    stats_rays_.store(0, std::memory_order_relaxed);
+    stats_nodes_.store(0, std::memory_order_relaxed);
 }
 
 std::shared_ptr <BVHNode> BVH::BuildTree(int from, int to, int depth) {
     auto node = std::make_shared<BVHNode>(from, to);
     node->bbox = CalculateNodeBounds(from, to);
-    if (to - from + 1 > max_leaf_items_){
-        int axis = depth % 3;
-        int pivot = (from + to) / 2;
 
-        std::nth_element(items_.begin() + from, items_.begin() + pivot, items_.begin() + to,
-                         [axis](const std::shared_ptr<BVHTriangle> &a, const std::shared_ptr<BVHTriangle> &b) {
-                             return a->get_center()[axis] < b->get_center()[axis];
-                         });
+    // the depth limit keeps every path within the traversal stack
+    const bool can_split = depth < BVH_STACK_SIZE - 1;
 
+    int pivot = -1;
+    if(can_split && settings_.split_method == BVHSplitMethod::SAH){
+        pivot = SplitSAH(from, to, node->bbox);
+    }
+    else if(can_split && to - from > settings_.max_leaf_items){
+        pivot = settings_.split_method == BVHSplitMethod::LBVH ? SplitMorton(from, to) : SplitMedian(from, to, depth);
+    }
+
+    if(pivot > from && pivot < to){
+        // both halves own disjoint ranges of prim_indices_, so they can be built concurrently
+#pragma omp task shared(node) if(pivot - from > settings_.parallel_min_items)
         node->children[0] = BuildTree(from, pivot, depth + 1);
         node->children[1] = BuildTree(pivot, to, depth + 1);
+#pragma omp taskwait
     }
     return node;
 }
 
-void BVH::Traverse(Ray &ray, const std::shared_ptr<BVHNode>& node, int depth) {
-    if(node->bbox->is_intersecting(ray)){
+int BVH::SplitMedian(int from, int to, int depth) {
+    int axis = depth % 3;
+    int pivot = (from + to) / 2;
 
-        if(node->is_leaf()){
-            // intersect all triangles
-            for(int i = node->span[0]; i < node->span[1]; i++){
-                items_[i]->is_intersected(ray);
+    std::nth_element(prim_indices_.begin() + from, prim_indices_.begin() + pivot, prim_indices_.begin() + to,
+                     [this, axis](int a, int b) {
+                         return prim_centroids_[a][axis] < prim_centroids_[b][axis];
+                     });
+    return pivot;
+}
+
+void BVH::SortByMortonCodes() {
+    const int count = (int) prim_indices_.size();
+
+    BVHBbox centroid_bounds = BVHBbox::empty();
+    for(int i = 0; i < count; i++){
+        centroid_bounds.grow(prim_centroids_[i]);
+    }
+    Vector3 extent = centroid_bounds.border_max - centroid_bounds.border_min;
+
+    // 10 bits per axis, interleaved as zyxzyx...
+    prim_morton_.resize(count);
+#pragma omp parallel for
+    for(int i = 0; i < count; i++){
+        unsigned int code = 0;
+        for(int axis = 0; axis < 3; axis++){
+            float offset = prim_centroids_[i][axis] - centroid_bounds.border_min[axis];
+            float normalized = extent[axis] > 0 ? offset / extent[axis] : 0.0f;
+            auto cell = (unsigned int) min(max(normalized * 1024.0f, 0.0f), 1023.0f);
+            for(int bit = 0; bit < 10; bit++){
+                code |= ((cell >> bit) & 1u) << (3 * bit + axis);
             }
-        } else {
-            Traverse(ray, node->children[0], depth + 1);
-            Traverse(ray, node->children[1], depth + 1);
+        }
+        prim_morton_[i] = code;
+    }
+
+    // LSD radix sort of the indices, three passes of 10 bits
+    std::vector<int> sorted(count);
+    std::vector<int> buckets(1024);
+    for(int shift = 0; shift < 30; shift += 10){
+        std::fill(buckets.begin(), buckets.end(), 0);
+        for(int i = 0; i < count; i++){
+            buckets[(prim_morton_[prim_indices_[i]] >> shift) & 1023u]++;
+        }
+        int sum = 0;
+        for(int &bucket : buckets){
+            int items = bucket;
+            bucket = sum;
+            sum += items;
+        }
+        for(int i = 0; i < count; i++){
+            int prim = prim_indices_[i];
+            sorted[buckets[(prim_morton_[prim] >> shift) & 1023u]++] = prim;
+        }
+        prim_indices_.swap(sorted);
+    }
+}
+
+int BVH::SplitMorton(int from, int to) {
+    // the range is sorted, so the first item with the highest differing bit set starts the right child
+    unsigned int first = prim_morton_[prim_indices_[from]];
+    unsigned int last = prim_morton_[prim_indices_[to - 1]];
+    if(first == last){
+        return (from + to) / 2;
+    }
+
+    unsigned int diff = first ^ last;
+    unsigned int bit = 1u << 29;
+    while((diff & bit) == 0){
+        bit >>= 1;
+    }
+
+    int low = from;
+    int high = to - 1;
+    while(low < high){
+        int middle = (low + high) / 2;
+        if(prim_morton_[prim_indices_[middle]] & bit){
+            high = middle;
+        }
+        else{
+            low = middle + 1;
         }
     }
+    return low;
 }
 
-std::shared_ptr<BVHBbox> BVH::CalculateNodeBounds(int from, int to) {
-    // // get the bounds of all vertices of all triangles in the current range
-    std::shared_ptr<BVHBbox> bbox = items_[from]->get_bbox();
-    for(int i = from + 1; i < to; i++){
-        std::shared_ptr<BVHBbox> triangle_bbox = items_[i]->get_bbox();
-        for(int j = 0; j < 3; j++){
-            bbox->border_min[j] = min(bbox->border_min[j], triangle_bbox->border_min[j]);
-            bbox->border_max[j] = max(bbox->border_max[j], triangle_bbox->border_max[j]);
+int BVH::SplitSAH(int from, int to, const BVHBbox &bounds) {
+    // returns the pivot of the cheapest binned split or -1 when a leaf is cheaper
+    const int count = to - from;
+    if(count <= 1){
+        return -1;
+    }
+
+    const BVHSplit split = FindObjectSplit(&prim_indices_[from], count);
+    if(split.axis == -1){
+        // all centroids coincide, SAH can not separate them
+        return count <= settings_.max_leaf_items * 4 ? -1 : (from + to) / 2;
+    }
+    if(IsLeafCheaper(split.cost, count, bounds)){
+        return -1;
+    }
+
+    const int bin_count = max(settings_.sah_bins, 2);
+    auto middle = std::partition(prim_indices_.begin() + from, prim_indices_.begin() + to,
+                                 [&](int prim) {
+                                     int bin = min(bin_count - 1,
+                                                   (int) ((prim_centroids_[prim][split.axis] - split.bin_min)
+                                                          * split.bin_scale));
+                                     return bin < split.bin;
+                                 });
+    return (int) (middle - prim_indices_.begin());
+}
+
+BVHSplit BVH::FindObjectSplit(const int *refs, int count) const {
+    BVHBbox centroid_bounds = BVHBbox::empty();
+    for(int i = 0; i < count; i++){
+        centroid_bounds.grow(prim_centroids_[refs[i]]);
+    }
+
+    const int bin_count = max(settings_.sah_bins, 2);
+    std::vector<BVHBbox> bin_bounds(bin_count);
+    std::vector<int> bin_items(bin_count);
+    std::vector<BVHBbox> right_bounds(bin_count);
+    std::vector<int> right_items(bin_count);
+
+    BVHSplit best;
+    for(int axis = 0; axis < 3; axis++){
+        float c_min = centroid_bounds.border_min[axis];
+        float c_max = centroid_bounds.border_max[axis];
+        if(c_max <= c_min){
+            continue;
+        }
+        float scale = bin_count / (c_max - c_min);
+
+        std::fill(bin_bounds.begin(), bin_bounds.end(), BVHBbox::empty());
+        std::fill(bin_items.begin(), bin_items.end(), 0);
+        for(int i = 0; i < count; i++){
+            int prim = refs[i];
+            int bin = min(bin_count - 1, (int) ((prim_centroids_[prim][axis] - c_min) * scale));
+            bin_bounds[bin].grow(prim_bounds_[prim]);
+            bin_items[bin]++;
+        }
+
+        // sweep from the right, then evaluate the planes between bins from the left
+        BVHBbox acc = BVHBbox::empty();
+        int acc_items = 0;
+        for(int b = bin_count - 1; b > 0; b--){
+            acc.grow(bin_bounds[b]);
+            acc_items += bin_items[b];
+            right_bounds[b] = acc;
+            right_items[b] = acc_items;
+        }
+
+        acc = BVHBbox::empty();
+        acc_items = 0;
+        for(int b = 1; b < bin_count; b++){
+            acc.grow(bin_bounds[b - 1]);
+            acc_items += bin_items[b - 1];
+            if(acc_items == 0 || right_items[b] == 0){
+                continue;
+            }
+
+            float cost = acc.surface_area() * acc_items + right_bounds[b].surface_area() * right_items[b];
+            if(cost < best.cost){
+                best.cost = cost;
+                best.axis = axis;
+                best.bin = b;
+                best.bin_min = c_min;
+                best.bin_scale = scale;
+                best.left_bounds = acc;
+                best.right_bounds = right_bounds[b];
+            }
         }
     }
+    return best;
+}
+
+float BVH::LeafCost(int count) const {
+    // leaves are tested in SIMD groups, a few more triangles in a leaf cost little until the next group starts
+    const int groups = (count + BVH_LEAF_GROUP - 1) / BVH_LEAF_GROUP;
+    return min((float) count, settings_.leaf_group_cost * groups) * settings_.intersection_cost;
+}
+
+bool BVH::IsLeafCheaper(float split_cost, int count, const BVHBbox &bounds) const {
+    float parent_area = bounds.surface_area();
+    float leaf_cost = LeafCost(count);
+    float cost = settings_.traversal_cost + settings_.intersection_cost * count;
+    if(parent_area > 0){
+        cost = settings_.traversal_cost + settings_.intersection_cost * split_cost / parent_area;
+    }
+    return cost >= leaf_cost && count <= settings_.max_leaf_items * 4;
+}
+
+int BVH::FlattenTree(const std::shared_ptr<BVHNode>& node) {
+    const int index = (int) nodes_.size();
+    nodes_.push_back(BVHFlatNode{node->bbox, node->span[0], node->span[1] - node->span[0]});
+
+    if(!node->is_leaf()){
+        FlattenTree(node->children[0]);
+        // nodes_ may reallocate in the call, so the index is stored only afterwards
+        const int right = FlattenTree(node->children[1]);
+        nodes_[index].offset = right;
+        nodes_[index].count = 0;
+    }
+    return index;
+}
+
+BVHBbox BVH::CalculateNodeBounds(int from, int to) const {
+    // get the bounds of all references in the current range
+    BVHBbox bbox = BVHBbox::empty();
+    for(int i = from; i < to; i++){
+        bbox.grow(prim_bounds_[prim_indices_[i]]);
+    }
 
     return bbox;
 }
 
-bool BVHBbox::is_intersecting(Ray &ray) {
-    // SLAB method
-    float tx0 = (border_min.x - ray.get_origin().x) / ray.get_direction().x;
-    float tx1 = (border_max.x - ray.get_origin().x) / ray.get_direction().x;
-    float ty0 = (border_min.y - ray.get_origin().y) / ray.get_direction().y;
-    float ty1 = (border_max.y - ray.get_origin().y) / ray.get_direction().y;
-    float tz0 = (border_min.z - ray.get_origin().z) / ray.get_direction().z;
-    float tz1 = (border_max.z - ray.get_origin().z) / ray.get_direction().z;
+float BVH::SAHCost() const {
+    if(nodes_.empty() || nodes_[0].bbox.surface_area() <= 0){
+        return 0;
+    }
+
+    float cost = 0;
+    for(const BVHFlatNode &node : nodes_){
+        float area = node.bbox.surface_area();
+        cost += node.is_leaf() ? area * LeafCost(node.count) : area * settings_.traversal_cost;
+    }
+    return cost / nodes_[0].bbox.surface_area();
+}
+
+float BVH::NodeBytesPerTriangle() const {
+    if(items_.empty()){
+        return 0;
+    }
+
+    size_t bytes = nodes_.size() * sizeof(BVHFlatNode);
+    if(!nodes4_.empty() || !nodes8_.empty() || !nodes4q_.empty() || !nodes8q_.empty()){
+        bytes = nodes4_.size() * sizeof(BVH4Node) + nodes8_.size() * sizeof(BVH8Node)
+                + nodes4q_.size() * sizeof(BVH4QNode) + nodes8q_.size() * sizeof(BVH8QNode);
+    }
+    return (float) bytes / (float) items_.size();
+}
+
+void BVHBbox::grow(const BVHBbox &other) {
+    border_min = Vector3(min(border_min.x, other.border_min.x), min(border_min.y, other.border_min.y),
+                         min(border_min.z, other.border_min.z));
+    border_max = Vector3(max(border_max.x, other.border_max.x), max(border_max.y, other.border_max.y),
+                         max(border_max.z, other.border_max.z));
+}
+
+void BVHBbox::grow(const Vector3 &point) {
+    grow(BVHBbox(point, point));
+}
 
-    if (tx0 > tx1) std::swap(tx0, tx1);
-    if (ty0 > ty1) std::swap(ty0, ty1);
-    if (tz0 > tz1) std::swap(tz0, tz1);
+BVHRay::BVHRay(const Ray &ray) : BVHRay(ray.get_origin(), ray.get_direction(), ray.get_tnear()) {
+}
+
+BVHRay::BVHRay(const Vector3 &origin, const Vector3 &direction, float tnear) {
+    this->origin = origin;
+    this->direction = direction;
+    this->tnear = tnear;
+    inv_direction = Vector3(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+    sign[0] = inv_direction.x < 0;
+    sign[1] = inv_direction.y < 0;
+    sign[2] = inv_direction.z < 0;
+}
 
-    float tmin = max(max(tx0, ty0), tz0);
-    float tmax = min(min(tx1, ty1), tz1);
+bool BVHBbox::is_intersecting(const BVHRay &ray, float tfar, float &tmin) const {
+    // SLAB method, the ray sign picks the near plane so no swaps are needed
+    float tx0 = ((ray.sign[0] ? border_max.x : border_min.x) - ray.origin.x) * ray.inv_direction.x;
+    float tx1 = ((ray.sign[0] ? border_min.x : border_max.x) - ray.origin.x) * ray.inv_direction.x;
+    float ty0 = ((ray.sign[1] ? border_max.y : border_min.y) - ray.origin.y) * ray.inv_direction.y;
+    float ty1 = ((ray.sign[1] ? border_min.y : border_max.y) - ray.origin.y) * ray.inv_direction.y;
+    float tz0 = ((ray.sign[2] ? border_max.z : border_min.z) - ray.origin.z) * ray.inv_direction.z;
+    float tz1 = ((ray.sign[2] ? border_min.z : border_max.z) - ray.origin.z) * ray.inv_direction.z;
+
+    tmin = max(max(tx0, ty0), max(tz0, ray.tnear));
+    float tmax = min(min(tx1, ty1), min(tz1, tfar));
+
+    return tmin <= tmax;
+}
+
+void BVHTriangleBuffer::resize(int count) {
+    this->count = count;
+    for(std::vector<float> *component : {&v0_x, &v0_y, &v0_z, &e1_x, &e1_y, &e1_z, &e2_x, &e2_y, &e2_z}){
+        component->resize(count + BVH_LEAF_GROUP - 1);
+    }
+}
 
-    return tmin <= tmax && tmax >= 0;
+void BVHTriangleBuffer::set(int i, const Vector3 &v0, const Vector3 &v1, const Vector3 &v2) {
+    const Vector3 e1 = v1 - v0;
+    const Vector3 e2 = v2 - v0;
+    v0_x[i] = v0.x;
+    v0_y[i] = v0.y;
+    v0_z[i] = v0.z;
+    e1_x[i] = e1.x;
+    e1_y[i] = e1.y;
+    e1_z[i] = e1.z;
+    e2_x[i] = e2.x;
+    e2_y[i] = e2.y;
+    e2_z[i] = e2.z;
 }
 
 void BVHTriangle::is_intersected(Ray &ray) {
@@ -112,19 +863,12 @@ void BVHTriangle::is_intersected(Ray &ray) {
     if (t > ray.get_tnear())
     {
         if (t < ray.get_tfar()) {
-            ray.bvh_hit_point->is_intersected = true;
-            ray.bvh_hit_point->tfar = t;
-            ray.bvh_hit_point->u = u;
-            ray.bvh_hit_point->v = v;
-            ray.bvh_hit_point->normal = get_normal(u, v);
-            ray.bvh_hit_point->text_coords = get_coords(u, v);
-            ray.bvh_hit_point->material = material;
+            ray.set_hit(t, geom_id, 0, u, v, get_normal(u, v), get_coords(u, v), material);
         }
     }
 }
 
 void BVHTriangle::calculate_bbox() {
-    bbox = std::make_shared<BVHBbox>();
     Vector3 v_min = vertices_[0].position;
     Vector3 v_max = vertices_[0].position;
 
@@ -136,8 +880,8 @@ void BVHTriangle::calculate_bbox() {
         }
     }
 
-    bbox->border_min = v_min;
-    bbox->border_max = v_max;
+    bbox.border_min = v_min;
+    bbox.border_max = v_max;
 }
 
 void BVHTriangle::calculate_area(){
@@ -10,10 +10,85 @@
 #include "material.h"
 #include <vector>
 #include <memory>
+#include <atomic>
+#include <utility>
 
+/*! \def BVH_STACK_SIZE
+\brief Depth of the traversal stack, the builders never go deeper.
+*/
+#define BVH_STACK_SIZE 64
+
+/*! \def BVH_PACKET_SIZE
+\brief Largest ray packet of TraverseBatch, one bit of the active mask per ray.
+*/
+#define BVH_PACKET_SIZE 16
+
+/*! \def BVH_TREELET_LEAVES
+\brief Leaves of one treelet rearranged by BVH::Optimize, the search is exponential in this.
+*/
+#define BVH_TREELET_LEAVES 7
+
+/*! \def BVH_LEAF_GROUP
+\brief Neighbouring leaf triangles intersected by one SIMD test, 8 with AVX and 4 with SSE.
+*/
+#if defined(__AVX__)
+#define BVH_LEAF_GROUP 8
+#else
+#define BVH_LEAF_GROUP 4
+#endif
 
 class Ray;
 class Material;
+struct BVHBeam;
+
+enum class BVHSplitMethod{
+    Median = 0,     // object median along depth % 3
+    SAH = 1,        // binned surface area heuristic
+    LBVH = 2,       // linear BVH, splits 30-bit Morton codes of the centroids at their highest differing bit
+    SBVH = 3,       // SAH with spatial splits, straddling triangles are clipped and referenced from both children
+};
+
+struct BVHSettings{
+    BVHSplitMethod split_method = BVHSplitMethod::SAH;
+    int width = 2;                  // 2 traverses the binary tree, 4 (SSE) and 8 (AVX) the collapsed wide trees
+    bool quantized = false;         // wide trees store child boxes in 8 bits per plane, smaller but looser
+    int max_leaf_items = 4;         // leaf size for the median split, upper bound of a SAH leaf is 4x this
+    int sah_bins = 16;
+    float traversal_cost = 1.0f;    // cost of one node visit relative to one triangle test
+    float intersection_cost = 1.0f;
+    float leaf_group_cost = 2.0f;   // SAH leaf termination: one SIMD test of BVH_LEAF_GROUP triangles, in
+                                    // multiples of intersection_cost
+    int parallel_min_items = 4096;  // subtrees with more items are built in their own OpenMP task
+    float rebuild_threshold = 1.5f; // Refit rebuilds once the SAH cost grows past this multiple of the built one
+    bool verbose = true;            // BuildTree prints its time and SAH cost
+    float sbvh_duplicates = 0.3f;   // SBVH: extra references allowed, as a fraction of the triangle count
+    float sbvh_overlap = 1e-5f;     // SBVH: spatial splits are tried where object split children overlap more
+                                    // than this fraction of the root area
+    int packet_size = 8;            // TraverseBatch: rays per packet (4, 8 or 16), 1 traces the batch ray by ray
+    int packet_min_active = 2;      // packet lanes finish a subtree alone once fewer rays than this are active
+    float optimize_seconds = 0;     // BuildTree spends up to this long rearranging treelets, 0 skips it
+    bool sort_rays = true;          // TraverseBatch traces the rays in the order of SortRays
+    int sort_cell_bits = 5;         // SortRays: the scene box is split into 2^bits origin cells per axis
+    int beam_rays = 64;             // TraverseBeam: neighbouring rays bounded by one beam
+    int beam_max_leaves = 48;       // TraverseBeam: bundles whose beam reaches more leaves go to TraverseBatch
+    int tune_random_rays = 16384;   // AutoTune: random rays added to the camera rays of the sample
+    int tune_passes = 3;            // AutoTune: the sample is traced this often per candidate, the best pass counts
+    int lazy_subtree_items = 4096;  // LazyBVH: top-level leaves hold up to this many triangles, each leaf gets its
+                                    // own tree once a ray reaches it
+};
+
+// per ray data for the slab tests, computed once before the traversal
+struct BVHRay {
+    Vector3 origin;
+    Vector3 direction;
+    Vector3 inv_direction;
+    int sign[3];
+    float tnear;
+
+    BVHRay() = default;
+    explicit BVHRay(const Ray &ray);
+    BVHRay(const Vector3 &origin, const Vector3 &direction, float tnear);
+};
 
 class BVHBbox{
 public:
@@ -24,7 +99,33 @@ public:
         border_max = Vector3(0, 0,  0);
     }
 
-    bool is_intersecting(Ray &ray);
+    BVHBbox(Vector3 border_min, Vector3 border_max){
+        this->border_min = border_min;
+        this->border_max = border_max;
+    }
+
+    // inverted box, any grow() call makes it valid
+    static BVHBbox empty(){
+        return {Vector3(FLT_MAX, FLT_MAX, FLT_MAX), Vector3(-FLT_MAX, -FLT_MAX, -FLT_MAX)};
+    }
+
+    void grow(const BVHBbox &other);
+    void grow(const Vector3 &point);
+
+    float surface_area() const{
+        Vector3 d = border_max - border_min;
+        if(d.x < 0 || d.y < 0 || d.z < 0){
+            return 0;
+        }
+        return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+
+    Vector3 get_center() const{
+        return (border_min + border_max) * 0.5f;
+    }
+
+    // slab test against [tnear, tfar], tmin receives the entry distance
+    bool is_intersecting(const BVHRay &ray, float tfar, float &tmin) const;
 };
 
 class BVHHitPoint{
@@ -36,7 +137,14 @@ public:
     Vector3 normal = {FLT_MAX, FLT_MAX, FLT_MAX};
     Coord2f text_coords;
     Material* material;
+    int prim_id = -1;           // set by the traversal together with tfar, u and v
+    int instance_id = -1;       // BVHScene only, instance that owns prim_id
+    unsigned int geom_id = RTC_INVALID_GEOMETRY_ID;
+    int visited_nodes = 0;
     BVHHitPoint() = default;
+
+    // copies a resolved hit into the ray, a miss leaves the ray untouched
+    void store(Ray &ray) const;
 };
 
 class BVHTriangle {
@@ -44,7 +152,7 @@ public:
     Vertex vertices_[3];
     unsigned int geom_id;
     Material* material;
-    std::shared_ptr<BVHBbox> bbox = nullptr;
+    BVHBbox bbox;
     float area = 0;
 
     BVHTriangle(Vertex a, Vertex b, Vertex c, unsigned int geom_id, Material* material){
@@ -78,10 +186,7 @@ public:
     void calculate_area();
     void calculate_bbox();
 
-    std::shared_ptr<BVHBbox> get_bbox(){
-        if(bbox == nullptr){
-            calculate_bbox();
-        }
+    const BVHBbox &get_bbox() const{
         return bbox;
     }
 
@@ -91,12 +196,11 @@ public:
 
 class BVHNode {
 public:
-    std::shared_ptr<BVHBbox> bbox;
+    BVHBbox bbox;
     int span [2]{};
     std::shared_ptr<BVHNode> children[2];
 
     BVHNode(int from, int to){
-        bbox = nullptr;
         span[0] = from;
         span[1] = to;
         children[0] = nullptr;
@@ -108,22 +212,269 @@ public:
     }
 };
 
+// node of the compiled tree, the left child always follows its parent in the array
+struct BVHFlatNode {
+    BVHBbox bbox;
+    int offset;     // leaf: first item, interior: index of the right child
+    int count;      // leaf: number of items, interior: 0
+
+    bool is_leaf() const{
+        return count > 0;
+    }
+};
+
+static_assert(sizeof(BVHFlatNode) == 32, "BVHFlatNode should fit two nodes into a cache line");
+
+// intersection data of all triangles in leaf order, one array per component
+struct BVHTriangleBuffer {
+    std::vector<float> v0_x, v0_y, v0_z;
+    std::vector<float> e1_x, e1_y, e1_z;   // v1 - v0
+    std::vector<float> e2_x, e2_y, e2_z;   // v2 - v0
+    int count = 0;
+
+    // the arrays run BVH_LEAF_GROUP - 1 entries past count, so a group test may start at any triangle
+    void resize(int count);
+    void set(int i, const Vector3 &v0, const Vector3 &v1, const Vector3 &v2);
+
+    int size() const{
+        return count;
+    }
+
+    bool intersect(int i, const BVHRay &ray, float &dist, float &u, float &v) const{
+        // Moller-Trumbore algorithm on the precomputed edges
+        const Vector3 edge1(e1_x[i], e1_y[i], e1_z[i]);
+        const Vector3 edge2(e2_x[i], e2_y[i], e2_z[i]);
+        const Vector3 h = ray.direction.CrossProduct(edge2);
+
+        float a = edge1.DotProduct(h);
+        if (a > -0.00001f && a < 0.00001f)
+            return false;
+
+        float f = 1.0f / a;
+        const Vector3 s = ray.origin - Vector3(v0_x[i], v0_y[i], v0_z[i]);
+
+        u = f * s.DotProduct(h);
+        if (u < 0.0f || u > 1.0f)
+            return false;
+        const Vector3 q = s.CrossProduct(edge1);
+
+        v = f * ray.direction.DotProduct(q);
+        if (v < 0.0f || u + v > 1.0f)
+            return false;
+
+        dist = f * edge2.DotProduct(q);
+        return true;
+    }
+};
+
+// N children of a collapsed node with their boxes stored per axis, so one SIMD slab test covers all of them
+template <int N>
+struct BVHWideNode {
+    static const int WIDTH = N;
+    float min_x[N], min_y[N], min_z[N];
+    float max_x[N], max_y[N], max_z[N];
+    int child[N];   // leaf: first item, interior: index of the child node, empty slot: -1
+    int count[N];   // leaf: number of items, interior or empty slot: 0
+};
+
+// best binned split of a set of references, bins map as (x - bin_min) * bin_scale along the axis
+struct BVHSplit {
+    float cost = FLT_MAX;   // area * items summed over both children
+    int axis = -1;
+    int bin = -1;           // first bin of the right child
+    bool spatial = false;   // bins over the node box instead of the centroids, straddling references are clipped
+    float bin_min = 0;
+    float bin_scale = 0;
+    BVHBbox left_bounds;
+    BVHBbox right_bounds;
+};
+
+using BVH4Node = BVHWideNode<4>;
+using BVH8Node = BVHWideNode<8>;
+
+// wide node with the child boxes quantized to 8-bit steps of the node box, min planes round down and max planes up,
+// so the decoded boxes always contain the exact ones
+template <int N>
+struct BVHQuantizedNode {
+    static const int WIDTH = N;
+    float origin[3];        // node box minimum
+    float scale[3];         // node box extent / 255
+    unsigned char min_x[N], min_y[N], min_z[N];
+    unsigned char max_x[N], max_y[N], max_z[N];
+    int child_count;        // used slots, they are packed at the front
+    int child[N];
+    int count[N];
+};
+
+using BVH4QNode = BVHQuantizedNode<4>;
+using BVH8QNode = BVHQuantizedNode<8>;
+
+// quality measures of a built tree, lets us compare builders and settings per asset
+struct BVHReport {
+    const char *split_method = "";
+    int node_count = 0;
+    int leaf_count = 0;
+    int reference_count = 0;        // triangles in the leaves, SBVH references some of them more than once
+    float sah_cost = 0;
+    int max_depth = 0;
+    float average_depth = 0;        // of the leaves, the root has depth 0
+    std::vector<int> leaf_sizes;    // number of leaves with i triangles
+    float sibling_overlap = 0;      // area of the overlap of two siblings relative to their parent, averaged
+    size_t node_bytes = 0;          // binary nodes plus the wide layout the traversal reads
+    size_t triangle_bytes = 0;      // intersection buffer and hit data in leaf order
+    size_t item_bytes = 0;          // BVHTriangle items kept for Refit and rebuilds
+    float rays_per_second = 0;      // random rays timed by RaysPerSecond, 0 when not measured
+
+    void Print() const;
+};
+
 class BVH {
 public:
-    explicit BVH(std::vector<std::shared_ptr<BVHTriangle>> items);
+    explicit BVH(std::vector<std::shared_ptr<BVHTriangle>> items, BVHSettings settings = BVHSettings());
 
 
     void BuildTree();
     void Traverse(Ray &ray);
 
+    // closest hits of a batch of rays, neighbouring rays should be coherent (camera samples of a pixel,
+    // their reflections), they are traced in packets over the binary tree
+    void TraverseBatch(Ray *rays, int count);
+
+    // order that groups a batch by direction octant and then by origin cell along a Morton curve, incoherent
+    // secondary rays traced in this order share more nodes between neighbours
+    void SortRays(const Ray *rays, int count, std::vector<int> &order) const;
+
+    // closest hits of a tile of primary rays, every bundle of neighbouring rays gathers the leaves its beam
+    // reaches in one walk of the binary tree and its rays only test those, wide bundles fall back to packets
+    void TraverseBeam(Ray *rays, int count);
+
+    // any hit in (tnear, tmax), stops at the first one and writes no hit attributes
+    bool Occluded(const Vector3 &origin, const Vector3 &direction, float tmax, float tnear = 0.001f);
+
+    // queries on an already prepared ray, BVHScene calls them with rays in object space
+    void Intersect(const BVHRay &ray, BVHHitPoint &hit);
+    bool Occluded(const BVHRay &ray, float tmax);
+    void ResolveHit(BVHHitPoint &hit) const;
+
+    // world box of the whole tree, empty before BuildTree
+    BVHBbox Bounds() const;
+
+    void SetSplitMethod(BVHSplitMethod split_method);
+
+    // picks the traversal kernel (2, 4 or 8), a built tree is collapsed again right away
+    void SetWidth(int width);
+    void SetQuantized(bool quantized);
+
+    // memory of the node layout the traversal reads, per triangle
+    float NodeBytesPerTriangle() const;
+
+    // expected cost of one ray (in triangle tests), lets us compare builders
+    float SAHCost() const;
+
+    // updates the node bounds after the triangle vertices moved, the topology must stay the same,
+    // returns true when the tree degraded too much and was rebuilt instead
+    bool Refit();
+
+    // wall time of the last BuildTree in seconds
+    float BuildTime() const;
+
+    // rearranges small treelets of a built tree to the topology with the lowest SAH cost, works on the output
+    // of every builder, stops after the given time or once a pass barely helps, returns the new cost
+    float Optimize(float seconds);
+
+    // builds candidate split methods, leaf sizes and widths one parameter at a time, traces the camera rays
+    // plus random rays through each and keeps the fastest tree, returns its settings and logs them for pinning
+    BVHSettings AutoTune(const std::vector<Ray> &camera_rays);
+
+    // walks the built tree, the renderers print it after loading a scene
+    BVHReport Report() const;
+
+    // closest hit rate over tune_random_rays random rays, the best of tune_passes passes
+    float RaysPerSecond();
+
+    // rays from random points of the box in random directions, the same sample for the same arguments
+    static std::vector<Ray> RandomRays(const BVHBbox &bounds, int count);
+
+    static const char *SplitMethodName(BVHSplitMethod split_method);
+
+    // average number of visited nodes per traversed ray, counted only with COLLECT_STATS
+    float AverageVisitedNodes() const;
+    void ResetStats();
+
+    static bool COLLECT_STATS;
+
 private:
-    std::shared_ptr<BVHNode> root_;
-    std::vector<std::shared_ptr<BVHTriangle>> items_;
-    int max_leaf_items_;
+    std::shared_ptr<BVHNode> root_;     // build time only, dropped once nodes_ is filled
+    std::vector<BVHFlatNode> nodes_;
+    std::vector<BVH4Node> nodes4_;
+    std::vector<BVH8Node> nodes8_;
+    std::vector<BVH4QNode> nodes4q_;
+    std::vector<BVH8QNode> nodes8q_;
+    std::vector<std::shared_ptr<BVHTriangle>> items_;   // in the order they were given, Refit reads them again
+    std::vector<int> leaf_items_;       // item of every leaf slot, leaves span index ranges of it
+    BVHSettings settings_;
+
+    // hot data for the intersection tests and cold data read once per hit, both in leaf order
+    BVHTriangleBuffer triangles_;
+    std::vector<Vertex> vertices_;      // three per triangle
+    std::vector<Material*> materials_;
+    std::vector<unsigned int> geom_ids_;
+
+    // per reference build data, a reference is one triangle or, with spatial splits, a clipped part of it
+    std::vector<BVHBbox> prim_bounds_;
+    std::vector<Vector3> prim_centroids_;
+    std::vector<int> prim_items_;       // item behind the reference
+    std::vector<int> prim_indices_;
+    std::vector<unsigned int> prim_morton_;
+
+    float build_time_ = 0;
+    float build_sah_cost_ = 0;
+
+    std::atomic<long long> stats_rays_{0};
+    std::atomic<long long> stats_nodes_{0};
 
     std::shared_ptr<BVHNode> BuildTree(int from, int to, int depth);
-    void Traverse(Ray &ray, const std::shared_ptr<BVHNode>& node, int depth);
-    std::shared_ptr<BVHBbox> CalculateNodeBounds(int from, int to);
+    int SplitMedian(int from, int to, int depth);
+    int SplitSAH(int from, int to, const BVHBbox &bounds);
+    BVHSplit FindObjectSplit(const int *refs, int count) const;
+    bool IsLeafCheaper(float split_cost, int count, const BVHBbox &bounds) const;
+
+    // SAH cost of intersecting a leaf of count triangles, not weighted by its area
+    float LeafCost(int count) const;
+    int SplitMorton(int from, int to);
+    void SortByMortonCodes();
+    int FlattenTree(const std::shared_ptr<BVHNode>& node);
+    void BuildTriangleBuffer();
+
+    // ANY_HIT kernels return as soon as something lies closer than hit.tfar
+    template <bool ANY_HIT> bool IntersectLeaf(int from, int count, const BVHRay &ray, BVHHitPoint &hit) const;
+    template <bool ANY_HIT> bool TraverseBinary(const BVHRay &ray, BVHHitPoint &hit, int root = 0);
+    void RecordStats(BVHHitPoint &hit, int visited, bool new_ray = true);
+
+    // ray packets, BVHPacket.cpp
+    void TraversePacket(const BVHRay *rays, BVHHitPoint *const *hits, int count);
+
+    // beams of primary rays, BVHBeam.cpp
+    bool GatherBeamLeaves(const BVHBeam &beam, std::vector<std::pair<float, int>> &leaves) const;
+
+    // parameter search, BVHTune.cpp
+    float TimeSample(const std::vector<Ray> &sample);
+
+    // wide trees, BVHWide.cpp
+    void BuildWideNodes();
+    template <int N> int CollapseNode(std::vector<BVHWideNode<N>> &wide_nodes, int node_index);
+    template <int N> void QuantizeNodes(std::vector<BVHWideNode<N>> &wide_nodes,
+                                        std::vector<BVHQuantizedNode<N>> &quantized_nodes);
+    template <typename NODE, bool ANY_HIT>
+    bool TraverseWide(const BVHRay &ray, BVHHitPoint &hit, const std::vector<NODE> &wide_nodes);
+    BVHBbox CalculateNodeBounds(int from, int to) const;
+
+    // spatial splits, BVHSpatial.cpp
+    std::shared_ptr<BVHNode> BuildSpatialTree(std::vector<int> &refs, float root_area, int depth);
+    BVHSplit FindSpatialSplit(const std::vector<int> &refs, const BVHBbox &bounds) const;
+    void SplitReferences(const std::vector<int> &refs, const BVHSplit &split,
+                         std::vector<int> &left, std::vector<int> &right);
+    BVHBbox ClipReference(int ref, int axis, float lo, float hi) const;
 
 };
 
@@ -0,0 +1,145 @@
+#include "stdafx.h"
+#include "BVH.h"
+
+#include <algorithm>
+#include <utility>
+
+// interval bounds of a bundle of rays, a box missed by the beam is missed by every ray of the bundle
+struct BVHBeam {
+    Vector3 origin_min, origin_max;
+    float inv_min[3], inv_max[3];   // interval of 1 / direction per axis
+    bool bounded[3];                // false where the directions change sign, such an axis culls nothing
+    float tnear;
+
+    BVHBeam(const Ray *rays, int count);
+
+    // conservative slab test, tmin receives a lower bound of the entry distance of every ray of the bundle
+    bool is_intersecting(const BVHBbox &bbox, float &tmin) const;
+};
+
+BVHBeam::BVHBeam(const Ray *rays, int count) {
+    BVHBbox origins = BVHBbox::empty();
+    Vector3 direction_min(FLT_MAX, FLT_MAX, FLT_MAX);
+    Vector3 direction_max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    tnear = FLT_MAX;
+    for(int i = 0; i < count; i++){
+        origins.grow(rays[i].get_origin());
+        const Vector3 direction = rays[i].get_direction();
+        for(int axis = 0; axis < 3; axis++){
+            direction_min[axis] = min(direction_min[axis], direction[axis]);
+            direction_max[axis] = max(direction_max[axis], direction[axis]);
+        }
+        tnear = min(tnear, rays[i].get_tnear());
+    }
+    origin_min = origins.border_min;
+    origin_max = origins.border_max;
+
+    for(int axis = 0; axis < 3; axis++){
+        bounded[axis] = direction_min[axis] > 0 || direction_max[axis] < 0;
+        inv_min[axis] = bounded[axis] ? 1.0f / direction_max[axis] : 0;
+        inv_max[axis] = bounded[axis] ? 1.0f / direction_min[axis] : 0;
+    }
+}
+
+static void MultiplyIntervals(float a0, float a1, float b0, float b1, float &lo, float &hi) {
+    const float p0 = a0 * b0, p1 = a0 * b1, p2 = a1 * b0, p3 = a1 * b1;
+    lo = min(min(p0, p1), min(p2, p3));
+    hi = max(max(p0, p1), max(p2, p3));
+}
+
+bool BVHBeam::is_intersecting(const BVHBbox &bbox, float &tmin) const {
+    // SLAB method on intervals, the near plane of every axis is the same for the whole bundle
+    tmin = tnear;
+    float tmax = FLT_MAX;
+    for(int axis = 0; axis < 3; axis++){
+        if(!bounded[axis]){
+            continue;
+        }
+        const bool negative = inv_max[axis] < 0;
+        const float near_plane = negative ? bbox.border_max[axis] : bbox.border_min[axis];
+        const float far_plane = negative ? bbox.border_min[axis] : bbox.border_max[axis];
+
+        float lo, hi, unused;
+        MultiplyIntervals(near_plane - origin_max[axis], near_plane - origin_min[axis],
+                          inv_min[axis], inv_max[axis], lo, unused);
+        MultiplyIntervals(far_plane - origin_max[axis], far_plane - origin_min[axis],
+                          inv_min[axis], inv_max[axis], unused, hi);
+        tmin = max(tmin, lo);
+        tmax = min(tmax, hi);
+    }
+    return tmin <= tmax;
+}
+
+bool BVH::GatherBeamLeaves(const BVHBeam &beam, std::vector<std::pair<float, int>> &leaves) const {
+    leaves.clear();
+    int stack[BVH_STACK_SIZE];
+    int stack_size = 0;
+
+    float tmin;
+    if(beam.is_intersecting(nodes_[0].bbox, tmin)){
+        stack[stack_size++] = 0;
+    }
+    while(stack_size > 0){
+        const int current = stack[--stack_size];
+        const BVHFlatNode &node = nodes_[current];
+        if(node.is_leaf()){
+            beam.is_intersecting(node.bbox, tmin);
+            leaves.emplace_back(tmin, current);
+            if((int) leaves.size() > settings_.beam_max_leaves){
+                return false;
+            }
+            continue;
+        }
+        for(int child : {node.offset, current + 1}){
+            if(beam.is_intersecting(nodes_[child].bbox, tmin)){
+                stack[stack_size++] = child;
+            }
+        }
+    }
+
+    // nearest leaves first, a ray stops at the first leaf that starts behind its hit
+    std::sort(leaves.begin(), leaves.end());
+    return true;
+}
+
+void BVH::TraverseBeam(Ray *rays, int count) {
+    if(nodes_.empty()){
+        return;
+    }
+
+    std::vector<std::pair<float, int>> leaves;
+    const int bundle = max(settings_.beam_rays, 1);
+    for(int first = 0; first < count; first += bundle){
+        const int size = count - first < bundle ? count - first : bundle;
+        Ray *bundle_rays = rays + first;
+
+        // a wide beam reaches most of the scene, packets cull better there
+        const BVHBeam beam(bundle_rays, size);
+        if(!GatherBeamLeaves(beam, leaves)){
+            TraverseBatch(bundle_rays, size);
+            continue;
+        }
+
+        for(int i = 0; i < size; i++){
+            Ray &ray = bundle_rays[i];
+            const BVHRay bvh_ray(ray);
+            BVHHitPoint hit;
+            hit.tfar = ray.get_tfar();
+            int visited = 0;
+            for(const std::pair<float, int> &leaf : leaves){
+                if(leaf.first > hit.tfar){
+                    break;
+                }
+                const BVHFlatNode &node = nodes_[leaf.second];
+                float tmin;
+                visited++;
+                if(node.bbox.is_intersecting(bvh_ray, hit.tfar, tmin)){
+                    IntersectLeaf<false>(node.offset, node.count, bvh_ray, hit);
+                }
+            }
+            RecordStats(hit, visited);
+            ResolveHit(hit);
+            hit.store(ray);
+        }
+    }
+}
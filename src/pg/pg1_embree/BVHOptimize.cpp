@@ -0,0 +1,258 @@
+#include "stdafx.h"
+#include "BVH.h"
+
+#include <iostream>
+#include <chrono>
+
+// binary tree with explicit links, treelets are rearranged in place and flattened again at the end
+struct BVHLinkedTree {
+    std::vector<BVHFlatNode> nodes;     // leaves keep offset and count, interior links live in left and right
+    std::vector<int> left;
+    std::vector<int> right;
+    std::vector<float> cost;            // SAH cost of the subtree, not divided by the root area
+};
+
+// node indices of one treelet, the root is internals[0]
+struct BVHTreelet {
+    int leaves[BVH_TREELET_LEAVES];
+    int internals[BVH_TREELET_LEAVES - 1];
+    int leaf_count = 0;
+    int internal_count = 0;
+};
+
+static BVHTreelet FormTreelet(const BVHLinkedTree &tree, int root) {
+    // keep opening the treelet leaf with the largest area, those matter most for the SAH cost
+    BVHTreelet treelet;
+    treelet.internals[treelet.internal_count++] = root;
+    treelet.leaves[treelet.leaf_count++] = tree.left[root];
+    treelet.leaves[treelet.leaf_count++] = tree.right[root];
+
+    while(treelet.leaf_count < BVH_TREELET_LEAVES){
+        int best = -1;
+        float best_area = -1;
+        for(int i = 0; i < treelet.leaf_count; i++){
+            const int node = treelet.leaves[i];
+            if(tree.left[node] >= 0 && tree.nodes[node].bbox.surface_area() > best_area){
+                best_area = tree.nodes[node].bbox.surface_area();
+                best = i;
+            }
+        }
+        if(best < 0){
+            break;
+        }
+
+        const int node = treelet.leaves[best];
+        treelet.internals[treelet.internal_count++] = node;
+        treelet.leaves[best] = tree.left[node];
+        treelet.leaves[treelet.leaf_count++] = tree.right[node];
+    }
+    return treelet;
+}
+
+static int EmitTreelet(BVHLinkedTree &tree, const BVHTreelet &treelet, const int *partition, int subset,
+                       int &next_internal) {
+    if((subset & (subset - 1)) == 0){
+        int leaf = 0;
+        while(!(subset & (1 << leaf))){
+            leaf++;
+        }
+        return treelet.leaves[leaf];
+    }
+
+    const int node = treelet.internals[next_internal++];
+    const int left = EmitTreelet(tree, treelet, partition, partition[subset], next_internal);
+    const int right = EmitTreelet(tree, treelet, partition, subset & ~partition[subset], next_internal);
+    tree.left[node] = left;
+    tree.right[node] = right;
+    tree.nodes[node].bbox = tree.nodes[left].bbox;
+    tree.nodes[node].bbox.grow(tree.nodes[right].bbox);
+    return node;
+}
+
+static void OptimizeTreelet(BVHLinkedTree &tree, int root, float traversal_cost) {
+    const BVHTreelet treelet = FormTreelet(tree, root);
+
+    float current_cost = 0;
+    for(int i = 0; i < treelet.internal_count; i++){
+        current_cost += traversal_cost * tree.nodes[treelet.internals[i]].bbox.surface_area();
+    }
+    for(int i = 0; i < treelet.leaf_count; i++){
+        current_cost += tree.cost[treelet.leaves[i]];
+    }
+
+    // two leaves have only one topology
+    const int n = treelet.leaf_count;
+    if(n < 3){
+        tree.cost[root] = current_cost;
+        return;
+    }
+
+    // optimal topology over all subsets of the treelet leaves, built up from the smaller ones
+    const int subsets = 1 << n;
+    float subset_cost[1 << BVH_TREELET_LEAVES];
+    int partition[1 << BVH_TREELET_LEAVES];
+    for(int s = 1; s < subsets; s++){
+        BVHBbox bounds = BVHBbox::empty();
+        for(int i = 0; i < n; i++){
+            if(s & (1 << i)){
+                bounds.grow(tree.nodes[treelet.leaves[i]].bbox);
+            }
+        }
+
+        if((s & (s - 1)) == 0){
+            int leaf = 0;
+            while(!(s & (1 << leaf))){
+                leaf++;
+            }
+            subset_cost[s] = tree.cost[treelet.leaves[leaf]];
+            continue;
+        }
+
+        // every split is seen twice, only the halves holding the lowest leaf are tried
+        const int lowest = s & -s;
+        float best = FLT_MAX;
+        int best_partition = lowest;
+        for(int p = (s - 1) & s; p > 0; p = (p - 1) & s){
+            if(!(p & lowest)){
+                continue;
+            }
+            const float cost = subset_cost[p] + subset_cost[s & ~p];
+            if(cost < best){
+                best = cost;
+                best_partition = p;
+            }
+        }
+        subset_cost[s] = traversal_cost * bounds.surface_area() + best;
+        partition[s] = best_partition;
+    }
+
+    const int all = subsets - 1;
+    if(subset_cost[all] < current_cost * 0.9999f){
+        int next_internal = 0;
+        EmitTreelet(tree, treelet, partition, all, next_internal);
+        tree.cost[root] = subset_cost[all];
+    }
+    else{
+        tree.cost[root] = current_cost;
+    }
+
+    // the internal nodes below the root got new subtrees, their costs are needed by the treelets above
+    for(int i = treelet.internal_count - 1; i > 0; i--){
+        const int node = treelet.internals[i];
+        tree.cost[node] = traversal_cost * tree.nodes[node].bbox.surface_area() + tree.cost[tree.left[node]]
+                          + tree.cost[tree.right[node]];
+    }
+}
+
+static std::vector<std::vector<int>> InteriorLevels(const BVHLinkedTree &tree) {
+    // interior nodes grouped by their current depth, treelets move nodes around so this is redone every pass
+    std::vector<std::vector<int>> levels;
+    std::vector<int> stack(1, 0);
+    std::vector<int> stack_depth(1, 0);
+    while(!stack.empty()){
+        const int node = stack.back();
+        const int depth = stack_depth.back();
+        stack.pop_back();
+        stack_depth.pop_back();
+        if(tree.left[node] < 0){
+            continue;
+        }
+        if((int) levels.size() <= depth){
+            levels.resize(depth + 1);
+        }
+        levels[depth].push_back(node);
+        for(int child : {tree.left[node], tree.right[node]}){
+            stack.push_back(child);
+            stack_depth.push_back(depth + 1);
+        }
+    }
+    return levels;
+}
+
+static int FlattenLinkedTree(const BVHLinkedTree &tree, int node, int depth, std::vector<BVHFlatNode> &nodes,
+                             int &max_depth) {
+    max_depth = max(max_depth, depth);
+    const int index = (int) nodes.size();
+    nodes.push_back(tree.nodes[node]);
+    if(tree.left[node] >= 0){
+        FlattenLinkedTree(tree, tree.left[node], depth + 1, nodes, max_depth);
+        const int right = FlattenLinkedTree(tree, tree.right[node], depth + 1, nodes, max_depth);
+        nodes[index].offset = right;
+        nodes[index].count = 0;
+    }
+    return index;
+}
+
+float BVH::Optimize(float seconds) {
+    if(nodes_.size() < 3){
+        return SAHCost();
+    }
+
+    auto t0 = std::chrono::high_resolution_clock::now();
+    auto elapsed = [&t0]() {
+        std::chrono::duration<float> duration = std::chrono::high_resolution_clock::now() - t0;
+        return duration.count();
+    };
+
+    const int count = (int) nodes_.size();
+    BVHLinkedTree tree;
+    tree.nodes = nodes_;
+    tree.left.assign(count, -1);
+    tree.right.assign(count, -1);
+    tree.cost.resize(count);
+    for(int i = 0; i < count; i++){
+        if(!nodes_[i].is_leaf()){
+            tree.left[i] = i + 1;
+            tree.right[i] = nodes_[i].offset;
+        }
+    }
+    for(int i = count - 1; i >= 0; i--){
+        const float area = nodes_[i].bbox.surface_area();
+        tree.cost[i] = nodes_[i].is_leaf() ? LeafCost(nodes_[i].count) * area
+                                           : settings_.traversal_cost * area + tree.cost[i + 1]
+                                             + tree.cost[nodes_[i].offset];
+    }
+
+    const float cost_before = SAHCost();
+    float cost = tree.cost[0];
+    int passes = 0;
+    bool out_of_time = false;
+    while(!out_of_time){
+        passes++;
+
+        // a treelet only rearranges nodes inside the subtree of its root, so the roots of one level are independent
+        const std::vector<std::vector<int>> levels = InteriorLevels(tree);
+        for(int level = (int) levels.size() - 1; level >= 0 && !out_of_time; level--){
+            const std::vector<int> &roots = levels[level];
+#pragma omp parallel for schedule(dynamic, 64)
+            for(int i = 0; i < (int) roots.size(); i++){
+                OptimizeTreelet(tree, roots[i], settings_.traversal_cost);
+            }
+            out_of_time = elapsed() > seconds;
+        }
+
+        // later passes find less and less, stop once one of them barely helped
+        const float previous = cost;
+        cost = tree.cost[0];
+        if(cost > previous * 0.999f){
+            break;
+        }
+    }
+
+    // rearranged treelets can be deeper than the traversal stack, such a result is thrown away
+    std::vector<BVHFlatNode> nodes;
+    nodes.reserve(count);
+    int new_depth = 0;
+    FlattenLinkedTree(tree, 0, 0, nodes, new_depth);
+    if(new_depth < BVH_STACK_SIZE){
+        nodes_ = std::move(nodes);
+        BuildWideNodes();
+        build_sah_cost_ = SAHCost();
+    }
+
+    if(settings_.verbose){
+        std::cout << "BVH treelet optimization: SAH cost " << cost_before << " -> " << SAHCost() << " in " << passes
+                  << " passes, " << elapsed() << " seconds" << std::endl;
+    }
+    return SAHCost();
+}
@@ -0,0 +1,333 @@
+#include "stdafx.h"
+#include "BVH.h"
+
+#include <immintrin.h>
+#include <utility>
+#include <cmath>
+#include <algorithm>
+
+// rays of one packet in SoA layout, all of them share the direction octant
+struct BVHPacket {
+    alignas(16) float origin_x[BVH_PACKET_SIZE];
+    alignas(16) float origin_y[BVH_PACKET_SIZE];
+    alignas(16) float origin_z[BVH_PACKET_SIZE];
+    alignas(16) float inv_x[BVH_PACKET_SIZE];
+    alignas(16) float inv_y[BVH_PACKET_SIZE];
+    alignas(16) float inv_z[BVH_PACKET_SIZE];
+    alignas(16) float direction_x[BVH_PACKET_SIZE];
+    alignas(16) float direction_y[BVH_PACKET_SIZE];
+    alignas(16) float direction_z[BVH_PACKET_SIZE];
+    alignas(16) float tnear[BVH_PACKET_SIZE];
+    alignas(16) float tfar[BVH_PACKET_SIZE];
+    int sign[3];
+    int size;       // lanes rounded up to the SSE width, the padding lanes never hit anything
+};
+
+static int CountLanes(unsigned mask) {
+    int count = 0;
+    for(; mask; mask &= mask - 1){
+        count++;
+    }
+    return count;
+}
+
+static unsigned IntersectPacket(const BVHBbox &box, const BVHPacket &packet, unsigned mask) {
+    // SLAB method for 4 rays at once, the shared octant picks the same near planes for all of them
+    const __m128 near_x = _mm_set1_ps(packet.sign[0] ? box.border_max.x : box.border_min.x);
+    const __m128 far_x = _mm_set1_ps(packet.sign[0] ? box.border_min.x : box.border_max.x);
+    const __m128 near_y = _mm_set1_ps(packet.sign[1] ? box.border_max.y : box.border_min.y);
+    const __m128 far_y = _mm_set1_ps(packet.sign[1] ? box.border_min.y : box.border_max.y);
+    const __m128 near_z = _mm_set1_ps(packet.sign[2] ? box.border_max.z : box.border_min.z);
+    const __m128 far_z = _mm_set1_ps(packet.sign[2] ? box.border_min.z : box.border_max.z);
+
+    unsigned result = 0;
+    for(int i = 0; i < packet.size; i += 4){
+        if(((mask >> i) & 0xF) == 0){
+            continue;
+        }
+        const __m128 origin_x = _mm_load_ps(packet.origin_x + i);
+        const __m128 origin_y = _mm_load_ps(packet.origin_y + i);
+        const __m128 origin_z = _mm_load_ps(packet.origin_z + i);
+        const __m128 inv_x = _mm_load_ps(packet.inv_x + i);
+        const __m128 inv_y = _mm_load_ps(packet.inv_y + i);
+        const __m128 inv_z = _mm_load_ps(packet.inv_z + i);
+
+        const __m128 t0x = _mm_mul_ps(_mm_sub_ps(near_x, origin_x), inv_x);
+        const __m128 t1x = _mm_mul_ps(_mm_sub_ps(far_x, origin_x), inv_x);
+        const __m128 t0y = _mm_mul_ps(_mm_sub_ps(near_y, origin_y), inv_y);
+        const __m128 t1y = _mm_mul_ps(_mm_sub_ps(far_y, origin_y), inv_y);
+        const __m128 t0z = _mm_mul_ps(_mm_sub_ps(near_z, origin_z), inv_z);
+        const __m128 t1z = _mm_mul_ps(_mm_sub_ps(far_z, origin_z), inv_z);
+
+        const __m128 tmin = _mm_max_ps(_mm_max_ps(t0x, t0y), _mm_max_ps(t0z, _mm_load_ps(packet.tnear + i)));
+        const __m128 tmax = _mm_min_ps(_mm_min_ps(t1x, t1y), _mm_min_ps(t1z, _mm_load_ps(packet.tfar + i)));
+        result |= (unsigned) _mm_movemask_ps(_mm_cmple_ps(tmin, tmax)) << i;
+    }
+    return result & mask;
+}
+
+static void IntersectPacketLeaf(const BVHTriangleBuffer &t, int from, int count, BVHPacket &packet, unsigned mask,
+                               BVHHitPoint *const *hits) {
+    // Moller-Trumbore algorithm for 4 rays at once, each triangle is loaded once for the whole packet
+    const __m128 epsilon = _mm_set1_ps(0.00001f);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    alignas(16) float dist[4], u[4], v[4];
+
+    for(int i = from; i < from + count; i++){
+        const __m128 e1x = _mm_set1_ps(t.e1_x[i]), e1y = _mm_set1_ps(t.e1_y[i]), e1z = _mm_set1_ps(t.e1_z[i]);
+        const __m128 e2x = _mm_set1_ps(t.e2_x[i]), e2y = _mm_set1_ps(t.e2_y[i]), e2z = _mm_set1_ps(t.e2_z[i]);
+        const __m128 v0x = _mm_set1_ps(t.v0_x[i]), v0y = _mm_set1_ps(t.v0_y[i]), v0z = _mm_set1_ps(t.v0_z[i]);
+
+        for(int g = 0; g < packet.size; g += 4){
+            const unsigned lanes = (mask >> g) & 0xF;
+            if(lanes == 0){
+                continue;
+            }
+            const __m128 dx = _mm_load_ps(packet.direction_x + g);
+            const __m128 dy = _mm_load_ps(packet.direction_y + g);
+            const __m128 dz = _mm_load_ps(packet.direction_z + g);
+
+            const __m128 hx = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+            const __m128 hy = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+            const __m128 hz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+            const __m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, hx), _mm_mul_ps(e1y, hy)), _mm_mul_ps(e1z, hz));
+            const __m128 f = _mm_div_ps(one, a);
+
+            const __m128 sx = _mm_sub_ps(_mm_load_ps(packet.origin_x + g), v0x);
+            const __m128 sy = _mm_sub_ps(_mm_load_ps(packet.origin_y + g), v0y);
+            const __m128 sz = _mm_sub_ps(_mm_load_ps(packet.origin_z + g), v0z);
+            const __m128 uu = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, hx), _mm_mul_ps(sy, hy)),
+                                                       _mm_mul_ps(sz, hz)));
+
+            const __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+            const __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+            const __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+            const __m128 vv = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)),
+                                                       _mm_mul_ps(dz, qz)));
+            const __m128 tt = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)),
+                                                       _mm_mul_ps(e2z, qz)));
+
+            __m128 valid = _mm_or_ps(_mm_cmple_ps(a, _mm_sub_ps(zero, epsilon)), _mm_cmpge_ps(a, epsilon));
+            valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(uu, zero), _mm_cmple_ps(uu, one)));
+            valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(vv, zero), _mm_cmple_ps(_mm_add_ps(uu, vv), one)));
+            valid = _mm_and_ps(valid, _mm_cmpgt_ps(tt, _mm_load_ps(packet.tnear + g)));
+            valid = _mm_and_ps(valid, _mm_cmplt_ps(tt, _mm_load_ps(packet.tfar + g)));
+
+            unsigned found = (unsigned) _mm_movemask_ps(valid) & lanes;
+            if(found == 0){
+                continue;
+            }
+            _mm_store_ps(dist, tt);
+            _mm_store_ps(u, uu);
+            _mm_store_ps(v, vv);
+            for(int k = 0; k < 4; k++){
+                if(found & (1u << k)){
+                    BVHHitPoint &hit = *hits[g + k];
+                    hit.tfar = dist[k];
+                    hit.u = u[k];
+                    hit.v = v[k];
+                    hit.prim_id = i;
+                    packet.tfar[g + k] = dist[k];
+                }
+            }
+        }
+    }
+}
+
+void BVH::SortRays(const Ray *rays, int count, std::vector<int> &order) const {
+    const BVHBbox bounds = Bounds();
+    const Vector3 extent = bounds.border_max - bounds.border_min;
+    const int bits = min(max(settings_.sort_cell_bits, 0), 9);
+    const float cells = (float) (1 << bits);
+
+    // octant in the top bits, the interleaved cell below it and the ray index in the low word keeps it stable
+    std::vector<unsigned long long> keys(count);
+    for(int i = 0; i < count; i++){
+        const Vector3 origin = rays[i].get_origin();
+        const Vector3 direction = rays[i].get_direction();
+        unsigned long long key = (direction.x < 0) | (direction.y < 0) << 1 | (direction.z < 0) << 2;
+        unsigned int code = 0;
+        for(int axis = 0; axis < 3; axis++){
+            float normalized = extent[axis] > 0 ? (origin[axis] - bounds.border_min[axis]) / extent[axis] : 0.0f;
+            auto cell = (unsigned int) min(max(normalized * cells, 0.0f), cells - 1);
+            for(int bit = 0; bit < bits; bit++){
+                code |= ((cell >> bit) & 1u) << (3 * bit + axis);
+            }
+        }
+        key = (key << (3 * bits) | code) << 32 | (unsigned int) i;
+        keys[i] = key;
+    }
+    std::sort(keys.begin(), keys.end());
+
+    order.resize(count);
+    for(int i = 0; i < count; i++){
+        order[i] = (int) (keys[i] & 0xFFFFFFFFull);
+    }
+}
+
+void BVH::TraverseBatch(Ray *rays, int count) {
+    const int packet_size = settings_.packet_size >= 16 ? 16 : settings_.packet_size >= 8 ? 8
+                          : settings_.packet_size >= 4 ? 4 : 1;
+
+    // the hits are written into the rays, so the batch comes back in its own order whatever order it is traced in
+    std::vector<int> order;
+    if(settings_.sort_rays && !nodes_.empty()){
+        SortRays(rays, count, order);
+    }
+    else{
+        order.resize(count);
+        for(int i = 0; i < count; i++){
+            order[i] = i;
+        }
+    }
+
+    if(packet_size == 1 || nodes_.empty()){
+        for(int i = 0; i < count; i++){
+            Traverse(rays[order[i]]);
+        }
+        return;
+    }
+
+    BVHRay packet_rays[BVH_PACKET_SIZE];
+    BVHHitPoint hit_storage[BVH_PACKET_SIZE];
+    BVHHitPoint *packet_hits[BVH_PACKET_SIZE];
+    Ray *packet_sources[BVH_PACKET_SIZE];
+    int octants[BVH_PACKET_SIZE];
+
+    for(int first = 0; first < count; first += packet_size){
+        const int lanes = count - first < packet_size ? count - first : packet_size;
+
+        // the largest group of rays with the same direction signs forms the packet
+        int octant_rays[8] = {};
+        for(int i = 0; i < lanes; i++){
+            packet_rays[i] = BVHRay(rays[order[first + i]]);
+            octants[i] = packet_rays[i].sign[0] | packet_rays[i].sign[1] << 1 | packet_rays[i].sign[2] << 2;
+            octant_rays[octants[i]]++;
+        }
+        int octant = 0;
+        for(int i = 1; i < 8; i++){
+            if(octant_rays[i] > octant_rays[octant]){
+                octant = i;
+            }
+        }
+        if(octant_rays[octant] < settings_.packet_min_active){
+            octant = -1;
+        }
+
+        // incoherent rays are traced one by one with the regular kernels
+        int size = 0;
+        for(int i = 0; i < lanes; i++){
+            Ray &ray = rays[order[first + i]];
+            BVHHitPoint &hit = hit_storage[size];
+            hit = BVHHitPoint();
+            hit.tfar = ray.get_tfar();
+            if(octants[i] != octant){
+                Intersect(packet_rays[i], hit);
+                ResolveHit(hit);
+                hit.store(ray);
+                continue;
+            }
+            packet_rays[size] = packet_rays[i];
+            packet_hits[size] = &hit;
+            packet_sources[size] = &ray;
+            size++;
+        }
+
+        if(size > 0){
+            TraversePacket(packet_rays, packet_hits, size);
+            for(int i = 0; i < size; i++){
+                ResolveHit(*packet_hits[i]);
+                packet_hits[i]->store(*packet_sources[i]);
+            }
+        }
+    }
+}
+
+void BVH::TraversePacket(const BVHRay *rays, BVHHitPoint *const *hits, int count) {
+    BVHPacket packet;
+    packet.size = (count + 3) & ~3;
+    for(int i = 0; i < 3; i++){
+        packet.sign[i] = rays[0].sign[i];
+    }
+    for(int i = 0; i < packet.size; i++){
+        const bool lane = i < count;
+        packet.origin_x[i] = lane ? rays[i].origin.x : 0;
+        packet.origin_y[i] = lane ? rays[i].origin.y : 0;
+        packet.origin_z[i] = lane ? rays[i].origin.z : 0;
+        packet.inv_x[i] = lane ? rays[i].inv_direction.x : 0;
+        packet.inv_y[i] = lane ? rays[i].inv_direction.y : 0;
+        packet.inv_z[i] = lane ? rays[i].inv_direction.z : 0;
+        packet.direction_x[i] = lane ? rays[i].direction.x : 0;
+        packet.direction_y[i] = lane ? rays[i].direction.y : 0;
+        packet.direction_z[i] = lane ? rays[i].direction.z : 0;
+        packet.tnear[i] = lane ? rays[i].tnear : 0;
+        packet.tfar[i] = lane ? hits[i]->tfar : -1;
+    }
+
+    int visited[BVH_PACKET_SIZE] = {};
+
+    // every entry carries the lanes that entered the node, one fetch of the node serves all of them
+    int stack_node[BVH_STACK_SIZE * 2];
+    unsigned stack_mask[BVH_STACK_SIZE * 2];
+    int stack_size = 0;
+
+    stack_node[0] = 0;
+    stack_mask[0] = (1u << count) - 1;
+    stack_size = 1;
+
+    while(stack_size > 0){
+        stack_size--;
+        const int current = stack_node[stack_size];
+        const BVHFlatNode &node = nodes_[current];
+
+        // boxes are tested on the pop, lanes whose closest hit shrank meanwhile drop out here
+        const unsigned mask = IntersectPacket(node.bbox, packet, stack_mask[stack_size]);
+        if(mask == 0){
+            continue;
+        }
+
+        if(CountLanes(mask) < settings_.packet_min_active){
+            // shared fetches no longer pay off, the remaining rays finish the subtree on their own
+            for(int i = 0; i < count; i++){
+                if(mask & (1u << i)){
+                    TraverseBinary<false>(rays[i], *hits[i], current);
+                    packet.tfar[i] = hits[i]->tfar;
+                }
+            }
+            continue;
+        }
+
+        for(int i = 0; i < count; i++){
+            if(mask & (1u << i)){
+                visited[i]++;
+            }
+        }
+
+        if(node.is_leaf()){
+            IntersectPacketLeaf(triangles_, node.offset, node.count, packet, mask, hits);
+            continue;
+        }
+
+        // the children are ordered once for the whole packet, along the axis that separates their centers most
+        int near_index = current + 1;
+        int far_index = node.offset;
+        const Vector3 offset = nodes_[far_index].bbox.get_center() - nodes_[near_index].bbox.get_center();
+        const int axis = fabsf(offset.x) > fabsf(offset.y) ? (fabsf(offset.x) > fabsf(offset.z) ? 0 : 2)
+                                                           : (fabsf(offset.y) > fabsf(offset.z) ? 1 : 2);
+        if((offset[axis] < 0) != (packet.sign[axis] != 0)){
+            std::swap(near_index, far_index);
+        }
+
+        stack_node[stack_size] = far_index;
+        stack_mask[stack_size] = mask;
+        stack_size++;
+        stack_node[stack_size] = near_index;
+        stack_mask[stack_size] = mask;
+        stack_size++;
+    }
+
+    for(int i = 0; i < count; i++){
+        RecordStats(*hits[i], visited[i]);
+    }
+}
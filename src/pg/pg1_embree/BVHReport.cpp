@@ -0,0 +1,95 @@
+#include "stdafx.h"
+#include "BVH.h"
+
+#include <iostream>
+
+BVHReport BVH::Report() const {
+    BVHReport report;
+    report.split_method = SplitMethodName(settings_.split_method);
+    report.node_count = (int) nodes_.size();
+    report.reference_count = (int) leaf_items_.size();
+    report.sah_cost = SAHCost();
+    if(nodes_.empty()){
+        return report;
+    }
+
+    // depth first over the flat array, the left child follows its parent
+    int stack[BVH_STACK_SIZE];
+    int stack_depth[BVH_STACK_SIZE];
+    int stack_size = 1;
+    stack[0] = 0;
+    stack_depth[0] = 0;
+
+    long long depth_sum = 0;
+    double overlap_sum = 0;
+    int interior_count = 0;
+    while(stack_size > 0){
+        stack_size--;
+        const int index = stack[stack_size];
+        const int depth = stack_depth[stack_size];
+        const BVHFlatNode &node = nodes_[index];
+
+        if(node.is_leaf()){
+            report.leaf_count++;
+            depth_sum += depth;
+            report.max_depth = max(report.max_depth, depth);
+            if((int) report.leaf_sizes.size() <= node.count){
+                report.leaf_sizes.resize(node.count + 1);
+            }
+            report.leaf_sizes[node.count]++;
+            continue;
+        }
+
+        const BVHBbox &left = nodes_[index + 1].bbox;
+        const BVHBbox &right = nodes_[node.offset].bbox;
+        BVHBbox overlap(Vector3(max(left.border_min.x, right.border_min.x), max(left.border_min.y, right.border_min.y),
+                                max(left.border_min.z, right.border_min.z)),
+                        Vector3(min(left.border_max.x, right.border_max.x), min(left.border_max.y, right.border_max.y),
+                                min(left.border_max.z, right.border_max.z)));
+        const float area = node.bbox.surface_area();
+        if(area > 0){
+            overlap_sum += overlap.surface_area() / area;
+        }
+        interior_count++;
+
+        stack[stack_size] = node.offset;
+        stack_depth[stack_size] = depth + 1;
+        stack_size++;
+        stack[stack_size] = index + 1;
+        stack_depth[stack_size] = depth + 1;
+        stack_size++;
+    }
+    report.average_depth = (float) depth_sum / (float) report.leaf_count;
+    report.sibling_overlap = interior_count > 0 ? (float) (overlap_sum / interior_count) : 0;
+
+    report.node_bytes = nodes_.size() * sizeof(BVHFlatNode) + nodes4_.size() * sizeof(BVH4Node)
+                        + nodes8_.size() * sizeof(BVH8Node) + nodes4q_.size() * sizeof(BVH4QNode)
+                        + nodes8q_.size() * sizeof(BVH8QNode);
+    report.triangle_bytes = triangles_.size() * 9 * sizeof(float) + vertices_.size() * sizeof(Vertex)
+                            + materials_.size() * sizeof(Material *);
+    report.item_bytes = items_.size() * (sizeof(std::shared_ptr<BVHTriangle>) + sizeof(BVHTriangle))
+                        + leaf_items_.size() * sizeof(int);
+    return report;
+}
+
+void BVHReport::Print() const {
+    std::cout << "BVH " << split_method << " report: " << node_count << " nodes, " << leaf_count << " leaves, "
+              << reference_count << " triangle references" << std::endl;
+    std::cout << "  SAH cost " << sah_cost << ", depth max " << max_depth << " average " << average_depth
+              << ", sibling overlap " << sibling_overlap * 100.0f << "% of the parent area" << std::endl;
+
+    std::cout << "  leaf sizes";
+    for(int i = 1; i < (int) leaf_sizes.size(); i++){
+        if(leaf_sizes[i] > 0){
+            std::cout << " " << i << ":" << leaf_sizes[i];
+        }
+    }
+    std::cout << std::endl;
+
+    std::cout << "  memory " << (node_bytes + triangle_bytes + item_bytes) / 1024 << " KB (nodes "
+              << node_bytes / 1024 << " KB, triangles " << triangle_bytes / 1024 << " KB, items "
+              << item_bytes / 1024 << " KB)" << std::endl;
+    if(rays_per_second > 0){
+        std::cout << "  traversal " << rays_per_second * 1e-6f << " Mrays/s over random rays" << std::endl;
+    }
+}
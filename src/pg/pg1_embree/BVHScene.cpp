@@ -0,0 +1,199 @@
+#include "stdafx.h"
+#include "BVHScene.h"
+
+#include <algorithm>
+#include <utility>
+#include <iostream>
+
+BVHScene::BVHScene(BVHSettings settings) : settings_(settings) {
+}
+
+int BVHScene::AddInstance(std::shared_ptr<BVH> blas, const Matrix3x3 &transform, const Vector3 &translation) {
+    instances_.emplace_back();
+    instances_.back().blas = std::move(blas);
+    SetTransform((int) instances_.size() - 1, transform, translation);
+    return (int) instances_.size() - 1;
+}
+
+void BVHScene::SetTransform(int instance, const Matrix3x3 &transform, const Vector3 &translation) {
+    BVHInstance &target = instances_[instance];
+    target.transform = transform;
+    target.translation = translation;
+    target.inverse = transform.Inverse();
+    target.normal_transform = target.inverse.Transpose();
+    UpdateBounds(target);
+}
+
+void BVHScene::UpdateBounds(BVHInstance &instance) const {
+    // transform all eight corners, the world box of a rotated box is larger than the original
+    const BVHBbox local = instance.blas->Bounds();
+    instance.bounds = BVHBbox::empty();
+    if(local.border_min.x > local.border_max.x){
+        return;
+    }
+
+    for(int corner = 0; corner < 8; corner++){
+        Vector3 point((corner & 1) ? local.border_max.x : local.border_min.x,
+                      (corner & 2) ? local.border_max.y : local.border_min.y,
+                      (corner & 4) ? local.border_max.z : local.border_min.z);
+        instance.bounds.grow(instance.transform * point + instance.translation);
+    }
+}
+
+int BVHScene::InstanceCount() const {
+    return (int) instances_.size();
+}
+
+void BVHScene::BuildTree() {
+    nodes_.clear();
+    instance_order_.clear();
+
+    // bottom-level trees may have been refitted or rebuilt since the instance was added
+    for(int i = 0; i < (int) instances_.size(); i++){
+        UpdateBounds(instances_[i]);
+        if(instances_[i].bounds.border_min.x <= instances_[i].bounds.border_max.x){
+            instance_order_.push_back(i);
+        }
+    }
+    if(instance_order_.empty()){
+        return;
+    }
+
+    BuildTree(0, (int) instance_order_.size());
+    if(settings_.verbose){
+        std::cout << "BVH scene built, " << instance_order_.size() << " instances, " << nodes_.size() << " nodes"
+                  << std::endl;
+    }
+}
+
+int BVHScene::BuildTree(int from, int to) {
+    BVHBbox bounds = BVHBbox::empty();
+    BVHBbox centroid_bounds = BVHBbox::empty();
+    for(int i = from; i < to; i++){
+        bounds.grow(instances_[instance_order_[i]].bounds);
+        centroid_bounds.grow(instances_[instance_order_[i]].bounds.get_center());
+    }
+
+    const int index = (int) nodes_.size();
+    nodes_.push_back(BVHFlatNode{bounds, from, to - from});
+    if(to - from <= 1){
+        return index;
+    }
+
+    // there are few instances, an object median along the widest centroid axis is good enough
+    Vector3 extent = centroid_bounds.border_max - centroid_bounds.border_min;
+    int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    const int pivot = (from + to) / 2;
+    std::nth_element(instance_order_.begin() + from, instance_order_.begin() + pivot, instance_order_.begin() + to,
+                     [&](int a, int b) {
+                         return instances_[a].bounds.get_center()[axis] < instances_[b].bounds.get_center()[axis];
+                     });
+
+    BuildTree(from, pivot);
+    const int right = BuildTree(pivot, to);
+    nodes_[index].offset = right;
+    nodes_[index].count = 0;
+    return index;
+}
+
+template <bool ANY_HIT>
+bool BVHScene::TraverseTree(const BVHRay &ray, BVHHitPoint &hit) {
+    int stack[BVH_STACK_SIZE];
+    float stack_tmin[BVH_STACK_SIZE];
+    int stack_size = 0;
+
+    float tmin;
+    int node_index = nodes_[0].bbox.is_intersecting(ray, hit.tfar, tmin) ? 0 : -1;
+    int instance_id = -1;
+
+    while(node_index >= 0){
+        const int current = node_index;
+        const BVHFlatNode &node = nodes_[current];
+        node_index = -1;
+
+        if(node.is_leaf()){
+            for(int i = node.offset; i < node.offset + node.count; i++){
+                const int id = instance_order_[i];
+                const BVHInstance &instance = instances_[id];
+
+                // the direction is not normalized again, so distances stay the same in both spaces
+                const BVHRay local(instance.inverse * (ray.origin - instance.translation),
+                                   instance.inverse * ray.direction, ray.tnear);
+                if(ANY_HIT){
+                    if(instance.blas->Occluded(local, hit.tfar)){
+                        return true;
+                    }
+                    continue;
+                }
+
+                const float tfar = hit.tfar;
+                instance.blas->Intersect(local, hit);
+                if(hit.tfar < tfar){
+                    instance_id = id;
+                }
+            }
+        } else {
+            int near_index = current + 1;
+            int far_index = node.offset;
+            float t_near, t_far;
+            bool hit_near = nodes_[near_index].bbox.is_intersecting(ray, hit.tfar, t_near);
+            bool hit_far = nodes_[far_index].bbox.is_intersecting(ray, hit.tfar, t_far);
+
+            if(hit_near && hit_far){
+                if(t_far < t_near){
+                    std::swap(near_index, far_index);
+                    std::swap(t_near, t_far);
+                }
+                stack[stack_size] = far_index;
+                stack_tmin[stack_size] = t_far;
+                stack_size++;
+                node_index = near_index;
+            }
+            else if(hit_near){
+                node_index = near_index;
+            }
+            else if(hit_far){
+                node_index = far_index;
+            }
+        }
+
+        while(node_index < 0 && stack_size > 0){
+            stack_size--;
+            if(stack_tmin[stack_size] <= hit.tfar){
+                node_index = stack[stack_size];
+            }
+        }
+    }
+
+    // only the owner of the closest hit interpolates, the normal goes back to world space
+    if(instance_id >= 0){
+        const BVHInstance &instance = instances_[instance_id];
+        instance.blas->ResolveHit(hit);
+        hit.instance_id = instance_id;
+        hit.normal = instance.normal_transform * hit.normal;
+
+        // the inverse transpose scales the normal whenever the instance is scaled
+        hit.normal.Normalize();
+        return true;
+    }
+    return false;
+}
+
+void BVHScene::Traverse(Ray &ray) {
+    if(nodes_.empty()){
+        return;
+    }
+    BVHHitPoint hit;
+    hit.tfar = ray.get_tfar();
+    TraverseTree<false>(BVHRay(ray), hit);
+    hit.store(ray);
+}
+
+bool BVHScene::Occluded(const Vector3 &origin, const Vector3 &direction, float tmax, float tnear) {
+    if(nodes_.empty()){
+        return false;
+    }
+    BVHHitPoint hit;
+    hit.tfar = tmax;
+    return TraverseTree<true>(BVHRay(origin, direction, tnear), hit);
+}
@@ -0,0 +1,48 @@
+#ifndef PG1_BVHSCENE_H
+#define PG1_BVHSCENE_H
+
+#include "BVH.h"
+#include "matrix3x3.h"
+
+// placement of one bottom-level BVH in the world, several instances may share the same tree
+struct BVHInstance {
+    std::shared_ptr<BVH> blas;
+    Matrix3x3 transform;            // object -> world
+    Vector3 translation;
+    Matrix3x3 inverse;              // world -> object
+    Matrix3x3 normal_transform;     // inverse transpose, object normals -> world
+    BVHBbox bounds;                 // world box of the transformed tree
+};
+
+// top-level BVH over instances, rays enter a bottom-level tree in its object space
+class BVHScene {
+public:
+    // only verbose is read, the bottom-level trees carry their own settings
+    explicit BVHScene(BVHSettings settings = BVHSettings());
+
+    // the bottom-level tree must be built before the top level is built
+    int AddInstance(std::shared_ptr<BVH> blas, const Matrix3x3 &transform = Matrix3x3(),
+                    const Vector3 &translation = Vector3(0, 0, 0));
+    void SetTransform(int instance, const Matrix3x3 &transform, const Vector3 &translation);
+
+    // rebuilds only the top level, changed bottom-level trees are rebuilt or refitted by the caller first
+    void BuildTree();
+    void Traverse(Ray &ray);
+    bool Occluded(const Vector3 &origin, const Vector3 &direction, float tmax, float tnear = 0.001f);
+
+    int InstanceCount() const;
+
+private:
+    std::vector<BVHInstance> instances_;
+    std::vector<BVHFlatNode> nodes_;    // leaves index instance_order_
+    std::vector<int> instance_order_;
+    BVHSettings settings_;
+
+    int BuildTree(int from, int to);
+    void UpdateBounds(BVHInstance &instance) const;
+
+    template <bool ANY_HIT> bool TraverseTree(const BVHRay &ray, BVHHitPoint &hit);
+};
+
+
+#endif //PG1_BVHSCENE_H
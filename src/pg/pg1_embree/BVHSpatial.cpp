@@ -0,0 +1,238 @@
+#include "stdafx.h"
+#include "BVH.h"
+
+#include <algorithm>
+
+static bool IsValid(const BVHBbox &bbox) {
+    return bbox.border_min.x <= bbox.border_max.x && bbox.border_min.y <= bbox.border_max.y
+           && bbox.border_min.z <= bbox.border_max.z;
+}
+
+std::shared_ptr<BVHNode> BVH::BuildSpatialTree(std::vector<int> &refs, float root_area, int depth) {
+    const int count = (int) refs.size();
+    BVHBbox bounds = BVHBbox::empty();
+    for(int ref : refs){
+        bounds.grow(prim_bounds_[ref]);
+    }
+
+    auto make_leaf = [&]() {
+        const int from = (int) prim_indices_.size();
+        prim_indices_.insert(prim_indices_.end(), refs.begin(), refs.end());
+        auto node = std::make_shared<BVHNode>(from, (int) prim_indices_.size());
+        node->bbox = bounds;
+        return node;
+    };
+
+    if(count <= 1 || depth >= BVH_STACK_SIZE - 1){
+        return make_leaf();
+    }
+
+    BVHSplit split = FindObjectSplit(refs.data(), count);
+
+    // spatial splits only pay off where the object split children overlap, and only while the budget lasts
+    const auto budget = (size_t) ((float) items_.size() * (1.0f + settings_.sbvh_duplicates));
+    if(split.axis >= 0 && prim_bounds_.size() + count <= budget){
+        BVHBbox overlap(Vector3(max(split.left_bounds.border_min.x, split.right_bounds.border_min.x),
+                                max(split.left_bounds.border_min.y, split.right_bounds.border_min.y),
+                                max(split.left_bounds.border_min.z, split.right_bounds.border_min.z)),
+                        Vector3(min(split.left_bounds.border_max.x, split.right_bounds.border_max.x),
+                                min(split.left_bounds.border_max.y, split.right_bounds.border_max.y),
+                                min(split.left_bounds.border_max.z, split.right_bounds.border_max.z)));
+        if(overlap.surface_area() > settings_.sbvh_overlap * root_area){
+            BVHSplit spatial = FindSpatialSplit(refs, bounds);
+            if(spatial.cost < split.cost){
+                split = spatial;
+            }
+        }
+    }
+
+    if(split.axis == -1){
+        // all centroids coincide and no plane separates the references
+        if(count <= settings_.max_leaf_items * 4){
+            return make_leaf();
+        }
+    }
+    else if(IsLeafCheaper(split.cost, count, bounds)){
+        return make_leaf();
+    }
+
+    std::vector<int> left;
+    std::vector<int> right;
+    if(split.axis == -1){
+        left.assign(refs.begin(), refs.begin() + count / 2);
+        right.assign(refs.begin() + count / 2, refs.end());
+    }
+    else{
+        SplitReferences(refs, split, left, right);
+    }
+    if(left.empty() || right.empty()){
+        return make_leaf();
+    }
+
+    // the reference lists of this level are not needed while the children are built
+    std::vector<int>().swap(refs);
+
+    auto left_node = BuildSpatialTree(left, root_area, depth + 1);
+    auto right_node = BuildSpatialTree(right, root_area, depth + 1);
+
+    auto node = std::make_shared<BVHNode>(left_node->span[0], right_node->span[1]);
+    node->bbox = bounds;
+    node->children[0] = left_node;
+    node->children[1] = right_node;
+    return node;
+}
+
+BVHSplit BVH::FindSpatialSplit(const std::vector<int> &refs, const BVHBbox &bounds) const {
+    // bins cover the node box, a reference is clipped to every bin it overlaps
+    const int bin_count = max(settings_.sah_bins, 2);
+    std::vector<BVHBbox> bin_bounds(bin_count);
+    std::vector<int> bin_entries(bin_count);
+    std::vector<int> bin_exits(bin_count);
+    std::vector<BVHBbox> right_bounds(bin_count);
+    std::vector<int> right_items(bin_count);
+
+    BVHSplit best;
+    for(int axis = 0; axis < 3; axis++){
+        float b_min = bounds.border_min[axis];
+        float b_max = bounds.border_max[axis];
+        if(b_max <= b_min){
+            continue;
+        }
+        float scale = bin_count / (b_max - b_min);
+
+        std::fill(bin_bounds.begin(), bin_bounds.end(), BVHBbox::empty());
+        std::fill(bin_entries.begin(), bin_entries.end(), 0);
+        std::fill(bin_exits.begin(), bin_exits.end(), 0);
+        for(int ref : refs){
+            const BVHBbox &ref_bounds = prim_bounds_[ref];
+            int first = max(0, min(bin_count - 1, (int) ((ref_bounds.border_min[axis] - b_min) * scale)));
+            int last = max(first, min(bin_count - 1, (int) ((ref_bounds.border_max[axis] - b_min) * scale)));
+            bin_entries[first]++;
+            bin_exits[last]++;
+
+            if(first == last){
+                bin_bounds[first].grow(ref_bounds);
+                continue;
+            }
+            for(int b = first; b <= last; b++){
+                bin_bounds[b].grow(ClipReference(ref, axis, b_min + b / scale, b_min + (b + 1) / scale));
+            }
+        }
+
+        BVHBbox acc = BVHBbox::empty();
+        int acc_items = 0;
+        for(int b = bin_count - 1; b > 0; b--){
+            acc.grow(bin_bounds[b]);
+            acc_items += bin_exits[b];
+            right_bounds[b] = acc;
+            right_items[b] = acc_items;
+        }
+
+        acc = BVHBbox::empty();
+        acc_items = 0;
+        for(int b = 1; b < bin_count; b++){
+            acc.grow(bin_bounds[b - 1]);
+            acc_items += bin_entries[b - 1];
+            if(acc_items == 0 || right_items[b] == 0){
+                continue;
+            }
+
+            float cost = acc.surface_area() * acc_items + right_bounds[b].surface_area() * right_items[b];
+            if(cost < best.cost){
+                best.cost = cost;
+                best.axis = axis;
+                best.bin = b;
+                best.spatial = true;
+                best.bin_min = b_min;
+                best.bin_scale = scale;
+                best.left_bounds = acc;
+                best.right_bounds = right_bounds[b];
+            }
+        }
+    }
+    return best;
+}
+
+void BVH::SplitReferences(const std::vector<int> &refs, const BVHSplit &split,
+                          std::vector<int> &left, std::vector<int> &right) {
+    const int bin_count = max(settings_.sah_bins, 2);
+    const int axis = split.axis;
+
+    if(!split.spatial){
+        for(int ref : refs){
+            int bin = min(bin_count - 1, (int) ((prim_centroids_[ref][axis] - split.bin_min) * split.bin_scale));
+            (bin < split.bin ? left : right).push_back(ref);
+        }
+        return;
+    }
+
+    // straddling references are clipped at the plane, the right part becomes a new reference
+    const float plane = split.bin_min + split.bin / split.bin_scale;
+    for(int ref : refs){
+        const BVHBbox &ref_bounds = prim_bounds_[ref];
+        int first = max(0, min(bin_count - 1,
+                               (int) ((ref_bounds.border_min[axis] - split.bin_min) * split.bin_scale)));
+        int last = max(first, min(bin_count - 1,
+                                  (int) ((ref_bounds.border_max[axis] - split.bin_min) * split.bin_scale)));
+        if(last < split.bin){
+            left.push_back(ref);
+            continue;
+        }
+        if(first >= split.bin){
+            right.push_back(ref);
+            continue;
+        }
+
+        // rounding can leave one side empty even though the bins said the reference straddles the plane
+        BVHBbox left_part = ClipReference(ref, axis, -FLT_MAX, plane);
+        BVHBbox right_part = ClipReference(ref, axis, plane, FLT_MAX);
+        if(!IsValid(right_part)){
+            left.push_back(ref);
+            continue;
+        }
+        if(!IsValid(left_part)){
+            right.push_back(ref);
+            continue;
+        }
+
+        prim_bounds_[ref] = left_part;
+        prim_centroids_[ref] = left_part.get_center();
+        left.push_back(ref);
+
+        const int item = prim_items_[ref];
+        prim_bounds_.push_back(right_part);
+        prim_centroids_.push_back(right_part.get_center());
+        prim_items_.push_back(item);
+        right.push_back((int) prim_bounds_.size() - 1);
+    }
+}
+
+BVHBbox BVH::ClipReference(int ref, int axis, float lo, float hi) const {
+    // bounds of the part of the triangle inside the slab [lo, hi], limited by the current reference box
+    const BVHTriangle &triangle = *items_[prim_items_[ref]];
+    BVHBbox clipped = BVHBbox::empty();
+    for(int i = 0; i < 3; i++){
+        Vector3 a = triangle.vertices_[i].position;
+        Vector3 b = triangle.vertices_[(i + 1) % 3].position;
+        if(a[axis] >= lo && a[axis] <= hi){
+            clipped.grow(a);
+        }
+        for(float plane : {lo, hi}){
+            if((a[axis] < plane && b[axis] > plane) || (a[axis] > plane && b[axis] < plane)){
+                float t = (plane - a[axis]) / (b[axis] - a[axis]);
+                Vector3 point = a + (b - a) * t;
+                point[axis] = plane;
+                clipped.grow(point);
+            }
+        }
+    }
+
+    const BVHBbox &ref_bounds = prim_bounds_[ref];
+    for(int k = 0; k < 3; k++){
+        clipped.border_min[k] = max(clipped.border_min[k], ref_bounds.border_min[k]);
+        clipped.border_max[k] = min(clipped.border_max[k], ref_bounds.border_max[k]);
+    }
+    clipped.border_min[axis] = max(clipped.border_min[axis], lo);
+    clipped.border_max[axis] = min(clipped.border_max[axis], hi);
+    return clipped;
+}
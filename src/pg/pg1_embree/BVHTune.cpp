@@ -0,0 +1,138 @@
+#include "stdafx.h"
+#include "BVH.h"
+
+#include <chrono>
+#include <iostream>
+
+std::vector<Ray> BVH::RandomRays(const BVHBbox &bounds, int count) {
+    std::mt19937 generator(7);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    std::vector<Ray> rays;
+    rays.reserve(count);
+    const Vector3 extent = bounds.border_max - bounds.border_min;
+    for(int i = 0; i < count; i++){
+        const Vector3 origin(bounds.border_min.x + unit(generator) * extent.x,
+                             bounds.border_min.y + unit(generator) * extent.y,
+                             bounds.border_min.z + unit(generator) * extent.z);
+        const float z = 2.0f * unit(generator) - 1.0f;
+        const float phi = 2.0f * float(M_PI) * unit(generator);
+        const float r = sqrtf(max(0.0f, 1.0f - z * z));
+        rays.emplace_back(origin, Vector3(r * cosf(phi), r * sinf(phi), z), 0.001f);
+    }
+    return rays;
+}
+
+float BVH::TimeSample(const std::vector<Ray> &sample) {
+    // best of a few passes, one pass of a small sample is easily disturbed by the other threads
+    float best = FLT_MAX;
+    for(int pass = 0; pass < settings_.tune_passes; pass++){
+        std::vector<Ray> rays = sample;
+        auto t0 = std::chrono::high_resolution_clock::now();
+        for(Ray &ray : rays){
+            Traverse(ray);
+        }
+        std::chrono::duration<float> duration = std::chrono::high_resolution_clock::now() - t0;
+        best = min(best, duration.count());
+    }
+    return best;
+}
+
+float BVH::RaysPerSecond() {
+    const std::vector<Ray> sample = RandomRays(Bounds(), settings_.tune_random_rays);
+    const float time = TimeSample(sample);
+    ResetStats();
+    return time > 0 ? sample.size() / time : 0;
+}
+
+static void PrintCandidate(const BVHSettings &settings, float build_time, float trace_time, int rays) {
+    std::cout << "  " << BVH::SplitMethodName(settings.split_method) << ", width " << settings.width
+              << ", max_leaf_items " << settings.max_leaf_items << ": built in " << build_time << " seconds, "
+              << rays / trace_time * 1e-6f << " Mrays/s" << std::endl;
+}
+
+BVHSettings BVH::AutoTune(const std::vector<Ray> &camera_rays) {
+    // the candidates are compared without treelet optimization, it runs once on the winner
+    const bool verbose = settings_.verbose;
+    const float optimize_seconds = settings_.optimize_seconds;
+    settings_.verbose = false;
+    settings_.optimize_seconds = 0;
+    if(verbose){
+        std::cout << "BVH auto-tune over " << items_.size() << " triangles" << std::endl;
+    }
+
+    BuildTree();
+    std::vector<Ray> sample = camera_rays;
+    const std::vector<Ray> random_rays = RandomRays(Bounds(), settings_.tune_random_rays);
+    sample.insert(sample.end(), random_rays.begin(), random_rays.end());
+    const int rays = (int) sample.size();
+
+    // one parameter at a time, every step keeps the best value so far, so only a handful of trees are built
+    BVHSettings best = settings_;
+    float best_time = TimeSample(sample);
+    if(verbose){
+        PrintCandidate(best, build_time_, best_time, rays);
+    }
+
+    const auto try_candidate = [&](const BVHSettings &candidate, bool rebuild) {
+        settings_ = candidate;
+        if(rebuild){
+            BuildTree();
+        }
+        else{
+            BuildWideNodes();
+        }
+        const float time = TimeSample(sample);
+        if(verbose){
+            PrintCandidate(candidate, build_time_, time, rays);
+        }
+        if(time < best_time){
+            best = candidate;
+            best_time = time;
+        }
+    };
+
+    for(BVHSplitMethod split_method : {BVHSplitMethod::SAH, BVHSplitMethod::SBVH, BVHSplitMethod::LBVH}){
+        if(split_method != best.split_method){
+            BVHSettings candidate = best;
+            candidate.split_method = split_method;
+            try_candidate(candidate, true);
+        }
+    }
+    for(int max_leaf_items : {2, 4, 8}){
+        if(max_leaf_items != best.max_leaf_items){
+            BVHSettings candidate = best;
+            candidate.max_leaf_items = max_leaf_items;
+            try_candidate(candidate, true);
+        }
+    }
+
+    // the width only collapses the binary tree differently, the best tree is built once more if it was not the last
+    if(settings_.split_method != best.split_method || settings_.max_leaf_items != best.max_leaf_items){
+        settings_ = best;
+        BuildTree();
+    }
+    for(int width : {2, 4, 8}){
+        if(width != best.width){
+            BVHSettings candidate = best;
+            candidate.width = width;
+            try_candidate(candidate, false);
+        }
+    }
+
+    settings_ = best;
+    BuildWideNodes();
+    ResetStats();
+    if(verbose){
+        std::cout << "BVH auto-tune picked " << SplitMethodName(best.split_method) << ", width " << best.width
+                  << ", max_leaf_items " << best.max_leaf_items << " (" << rays / best_time * 1e-6f
+                  << " Mrays/s), pin it with BVHSettings::split_method, width and max_leaf_items" << std::endl;
+    }
+    settings_.verbose = verbose;
+    settings_.optimize_seconds = optimize_seconds;
+    if(optimize_seconds > 0){
+        Optimize(optimize_seconds);
+    }
+    best.verbose = verbose;
+    best.optimize_seconds = optimize_seconds;
+    return best;
+}
@@ -0,0 +1,352 @@
+#include "stdafx.h"
+#include "BVH.h"
+
+#include <immintrin.h>
+#include <cstring>
+#include <cmath>
+
+// broadcast ray data for the SIMD slab tests
+struct BVHWideRay {
+    float origin[3];
+    float inv_direction[3];
+    int sign[3];
+    float tnear;
+
+    explicit BVHWideRay(const BVHRay &ray) {
+        origin[0] = ray.origin.x;
+        origin[1] = ray.origin.y;
+        origin[2] = ray.origin.z;
+        inv_direction[0] = ray.inv_direction.x;
+        inv_direction[1] = ray.inv_direction.y;
+        inv_direction[2] = ray.inv_direction.z;
+        sign[0] = ray.sign[0];
+        sign[1] = ray.sign[1];
+        sign[2] = ray.sign[2];
+        tnear = ray.tnear;
+    }
+};
+
+static int IntersectChildren4(const float *min_x, const float *min_y, const float *min_z,
+                              const float *max_x, const float *max_y, const float *max_z,
+                              const BVHWideRay &ray, float tfar, float *tmin) {
+    // SLAB method for 4 boxes at once, empty slots have inverted boxes and never pass
+    const __m128 t0x = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(ray.sign[0] ? max_x : min_x), _mm_set1_ps(ray.origin[0])),
+                                  _mm_set1_ps(ray.inv_direction[0]));
+    const __m128 t1x = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(ray.sign[0] ? min_x : max_x), _mm_set1_ps(ray.origin[0])),
+                                  _mm_set1_ps(ray.inv_direction[0]));
+    const __m128 t0y = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(ray.sign[1] ? max_y : min_y), _mm_set1_ps(ray.origin[1])),
+                                  _mm_set1_ps(ray.inv_direction[1]));
+    const __m128 t1y = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(ray.sign[1] ? min_y : max_y), _mm_set1_ps(ray.origin[1])),
+                                  _mm_set1_ps(ray.inv_direction[1]));
+    const __m128 t0z = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(ray.sign[2] ? max_z : min_z), _mm_set1_ps(ray.origin[2])),
+                                  _mm_set1_ps(ray.inv_direction[2]));
+    const __m128 t1z = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(ray.sign[2] ? min_z : max_z), _mm_set1_ps(ray.origin[2])),
+                                  _mm_set1_ps(ray.inv_direction[2]));
+
+    const __m128 t_enter = _mm_max_ps(_mm_max_ps(t0x, t0y), _mm_max_ps(t0z, _mm_set1_ps(ray.tnear)));
+    const __m128 t_exit = _mm_min_ps(_mm_min_ps(t1x, t1y), _mm_min_ps(t1z, _mm_set1_ps(tfar)));
+
+    _mm_storeu_ps(tmin, t_enter);
+    return _mm_movemask_ps(_mm_cmple_ps(t_enter, t_exit));
+}
+
+static int IntersectChildren(const BVH4Node &node, const BVHWideRay &ray, float tfar, float *tmin) {
+    return IntersectChildren4(node.min_x, node.min_y, node.min_z, node.max_x, node.max_y, node.max_z,
+                              ray, tfar, tmin);
+}
+
+static int IntersectChildren(const BVH8Node &node, const BVHWideRay &ray, float tfar, float *tmin) {
+#if defined(__AVX__)
+    const __m256 t0x = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(ray.sign[0] ? node.max_x : node.min_x),
+                                                   _mm256_set1_ps(ray.origin[0])), _mm256_set1_ps(ray.inv_direction[0]));
+    const __m256 t1x = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(ray.sign[0] ? node.min_x : node.max_x),
+                                                   _mm256_set1_ps(ray.origin[0])), _mm256_set1_ps(ray.inv_direction[0]));
+    const __m256 t0y = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(ray.sign[1] ? node.max_y : node.min_y),
+                                                   _mm256_set1_ps(ray.origin[1])), _mm256_set1_ps(ray.inv_direction[1]));
+    const __m256 t1y = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(ray.sign[1] ? node.min_y : node.max_y),
+                                                   _mm256_set1_ps(ray.origin[1])), _mm256_set1_ps(ray.inv_direction[1]));
+    const __m256 t0z = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(ray.sign[2] ? node.max_z : node.min_z),
+                                                   _mm256_set1_ps(ray.origin[2])), _mm256_set1_ps(ray.inv_direction[2]));
+    const __m256 t1z = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(ray.sign[2] ? node.min_z : node.max_z),
+                                                   _mm256_set1_ps(ray.origin[2])), _mm256_set1_ps(ray.inv_direction[2]));
+
+    const __m256 t_enter = _mm256_max_ps(_mm256_max_ps(t0x, t0y), _mm256_max_ps(t0z, _mm256_set1_ps(ray.tnear)));
+    const __m256 t_exit = _mm256_min_ps(_mm256_min_ps(t1x, t1y), _mm256_min_ps(t1z, _mm256_set1_ps(tfar)));
+
+    _mm256_storeu_ps(tmin, t_enter);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t_enter, t_exit, _CMP_LE_OQ));
+#else
+    // without AVX the 8 boxes go through the SSE kernel in two halves
+    int low = IntersectChildren4(node.min_x, node.min_y, node.min_z, node.max_x, node.max_y, node.max_z,
+                                 ray, tfar, tmin);
+    int high = IntersectChildren4(node.min_x + 4, node.min_y + 4, node.min_z + 4,
+                                  node.max_x + 4, node.max_y + 4, node.max_z + 4, ray, tfar, tmin + 4);
+    return low | (high << 4);
+#endif
+}
+
+static inline __m128 DecodePlanes4(const unsigned char *planes, float origin, float scale) {
+    // widen 4 bytes to 32-bit lanes, SSE2 only
+    int packed;
+    std::memcpy(&packed, planes, sizeof(packed));
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i lanes = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+    return _mm_add_ps(_mm_set1_ps(origin), _mm_mul_ps(_mm_cvtepi32_ps(lanes), _mm_set1_ps(scale)));
+}
+
+template <int N>
+static int IntersectChildren(const BVHQuantizedNode<N> &node, const BVHWideRay &ray, float tfar, float *tmin) {
+    // decode the boxes on the stack and reuse the full precision slab test
+    BVHWideNode<N> decoded;
+    for(int i = 0; i < N; i += 4){
+        _mm_storeu_ps(decoded.min_x + i, DecodePlanes4(node.min_x + i, node.origin[0], node.scale[0]));
+        _mm_storeu_ps(decoded.min_y + i, DecodePlanes4(node.min_y + i, node.origin[1], node.scale[1]));
+        _mm_storeu_ps(decoded.min_z + i, DecodePlanes4(node.min_z + i, node.origin[2], node.scale[2]));
+        _mm_storeu_ps(decoded.max_x + i, DecodePlanes4(node.max_x + i, node.origin[0], node.scale[0]));
+        _mm_storeu_ps(decoded.max_y + i, DecodePlanes4(node.max_y + i, node.origin[1], node.scale[1]));
+        _mm_storeu_ps(decoded.max_z + i, DecodePlanes4(node.max_z + i, node.origin[2], node.scale[2]));
+    }
+    return IntersectChildren(decoded, ray, tfar, tmin) & ((1 << node.child_count) - 1);
+}
+
+void BVH::BuildWideNodes() {
+    nodes4_.clear();
+    nodes8_.clear();
+    nodes4q_.clear();
+    nodes8q_.clear();
+    if(nodes_.empty()){
+        return;
+    }
+
+    if(settings_.width == 4){
+        CollapseNode(nodes4_, 0);
+        if(settings_.quantized){
+            QuantizeNodes(nodes4_, nodes4q_);
+        }
+    }
+    else if(settings_.width == 8){
+        CollapseNode(nodes8_, 0);
+        if(settings_.quantized){
+            QuantizeNodes(nodes8_, nodes8q_);
+        }
+    }
+}
+
+template <int N>
+int BVH::CollapseNode(std::vector<BVHWideNode<N>> &wide_nodes, int node_index) {
+    // pull up to N binary descendants into one node, always opening the largest interior child
+    int children[N];
+    int child_count = 0;
+
+    const BVHFlatNode &binary_node = nodes_[node_index];
+    if(binary_node.is_leaf()){
+        children[child_count++] = node_index;
+    }
+    else{
+        children[child_count++] = node_index + 1;
+        children[child_count++] = binary_node.offset;
+    }
+
+    while(child_count < N){
+        int best = -1;
+        float best_area = -1;
+        for(int i = 0; i < child_count; i++){
+            const BVHFlatNode &child = nodes_[children[i]];
+            if(!child.is_leaf() && child.bbox.surface_area() > best_area){
+                best_area = child.bbox.surface_area();
+                best = i;
+            }
+        }
+        if(best < 0){
+            break;
+        }
+
+        int opened = children[best];
+        children[best] = opened + 1;
+        children[child_count++] = nodes_[opened].offset;
+    }
+
+    const int index = (int) wide_nodes.size();
+    wide_nodes.emplace_back();
+
+    BVHWideNode<N> node;
+    for(int i = 0; i < N; i++){
+        if(i >= child_count){
+            node.min_x[i] = node.min_y[i] = node.min_z[i] = FLT_MAX;
+            node.max_x[i] = node.max_y[i] = node.max_z[i] = -FLT_MAX;
+            node.child[i] = -1;
+            node.count[i] = 0;
+            continue;
+        }
+
+        const BVHFlatNode &child = nodes_[children[i]];
+        node.min_x[i] = child.bbox.border_min.x;
+        node.min_y[i] = child.bbox.border_min.y;
+        node.min_z[i] = child.bbox.border_min.z;
+        node.max_x[i] = child.bbox.border_max.x;
+        node.max_y[i] = child.bbox.border_max.y;
+        node.max_z[i] = child.bbox.border_max.z;
+
+        if(child.is_leaf()){
+            node.child[i] = child.offset;
+            node.count[i] = child.count;
+        }
+        else{
+            node.child[i] = CollapseNode(wide_nodes, children[i]);
+            node.count[i] = 0;
+        }
+    }
+
+    wide_nodes[index] = node;
+    return index;
+}
+
+template <int N>
+void BVH::QuantizeNodes(std::vector<BVHWideNode<N>> &wide_nodes, std::vector<BVHQuantizedNode<N>> &quantized_nodes) {
+    quantized_nodes.resize(wide_nodes.size());
+    for(size_t n = 0; n < wide_nodes.size(); n++){
+        const BVHWideNode<N> &node = wide_nodes[n];
+        BVHQuantizedNode<N> &quantized = quantized_nodes[n];
+        const float *node_min[3] = {node.min_x, node.min_y, node.min_z};
+        const float *node_max[3] = {node.max_x, node.max_y, node.max_z};
+        unsigned char *quantized_min[3] = {quantized.min_x, quantized.min_y, quantized.min_z};
+        unsigned char *quantized_max[3] = {quantized.max_x, quantized.max_y, quantized.max_z};
+
+        quantized.child_count = 0;
+        while(quantized.child_count < N && node.child[quantized.child_count] >= 0){
+            quantized.child_count++;
+        }
+
+        for(int k = 0; k < 3; k++){
+            float lo = FLT_MAX;
+            float hi = -FLT_MAX;
+            for(int i = 0; i < quantized.child_count; i++){
+                lo = min(lo, node_min[k][i]);
+                hi = max(hi, node_max[k][i]);
+            }
+
+            // the margin covers the rounding of the decode, so no plane moves inside the exact box
+            const float margin = 1e-6f * (std::fabs(lo) + std::fabs(hi)) + 1e-30f;
+            const float scale = (hi - lo + 2 * margin) / 255.0f;
+            quantized.origin[k] = lo;
+            quantized.scale[k] = scale;
+
+            for(int i = 0; i < N; i++){
+                if(i >= quantized.child_count){
+                    quantized_min[k][i] = 255;
+                    quantized_max[k][i] = 0;
+                    continue;
+                }
+
+                int q_min = max(0, min(255, (int) std::floor((node_min[k][i] - lo) / scale)));
+                int q_max = max(0, min(255, (int) std::ceil((node_max[k][i] - lo) / scale)));
+                while(q_min > 0 && lo + q_min * scale > node_min[k][i] - margin){
+                    q_min--;
+                }
+                while(q_max < 255 && lo + q_max * scale < node_max[k][i] + margin){
+                    q_max++;
+                }
+                quantized_min[k][i] = (unsigned char) q_min;
+                quantized_max[k][i] = (unsigned char) q_max;
+            }
+        }
+
+        for(int i = 0; i < N; i++){
+            quantized.child[i] = node.child[i];
+            quantized.count[i] = node.count[i];
+        }
+    }
+
+    // only the quantized layout stays in memory
+    std::vector<BVHWideNode<N>>().swap(wide_nodes);
+}
+
+template <typename NODE, bool ANY_HIT>
+bool BVH::TraverseWide(const BVHRay &ray, BVHHitPoint &hit, const std::vector<NODE> &wide_nodes) {
+    const int N = NODE::WIDTH;
+    const BVHWideRay wide_ray(ray);
+    int visited = 0;
+
+    // both interior nodes and leaves go on the stack, a leaf is recognized by its count
+    int stack_child[BVH_STACK_SIZE * N];
+    int stack_count[BVH_STACK_SIZE * N];
+    float stack_tmin[BVH_STACK_SIZE * N];
+    int stack_size = 0;
+
+    stack_child[0] = 0;
+    stack_count[0] = 0;
+    stack_tmin[0] = ray.tnear;
+    stack_size = 1;
+
+    float tmin[N];
+    int hits[N];
+
+    while(stack_size > 0){
+        stack_size--;
+        if(stack_tmin[stack_size] > hit.tfar){
+            continue;
+        }
+
+        const int child = stack_child[stack_size];
+        const int count = stack_count[stack_size];
+        if(count > 0){
+            if(IntersectLeaf<ANY_HIT>(child, count, ray, hit) && ANY_HIT){
+                RecordStats(hit, visited);
+                return true;
+            }
+            continue;
+        }
+
+        const NODE &node = wide_nodes[child];
+        visited++;
+
+        const int mask = IntersectChildren(node, wide_ray, hit.tfar, tmin);
+        if(mask == 0){
+            continue;
+        }
+
+        // order the hit children far to near so the nearest one is popped first
+        int hit_count = 0;
+        for(int i = 0; i < N; i++){
+            if(mask & (1 << i)){
+                int j = hit_count++;
+                while(j > 0 && tmin[hits[j - 1]] < tmin[i]){
+                    hits[j] = hits[j - 1];
+                    j--;
+                }
+                hits[j] = i;
+            }
+        }
+
+        for(int j = 0; j < hit_count; j++){
+            stack_child[stack_size] = node.child[hits[j]];
+            stack_count[stack_size] = node.count[hits[j]];
+            stack_tmin[stack_size] = tmin[hits[j]];
+            stack_size++;
+        }
+    }
+
+    RecordStats(hit, visited);
+    return hit.prim_id >= 0;
+}
+
+template int BVH::CollapseNode<4>(std::vector<BVH4Node> &wide_nodes, int node_index);
+template int BVH::CollapseNode<8>(std::vector<BVH8Node> &wide_nodes, int node_index);
+template void BVH::QuantizeNodes<4>(std::vector<BVH4Node> &wide_nodes, std::vector<BVH4QNode> &quantized_nodes);
+template void BVH::QuantizeNodes<8>(std::vector<BVH8Node> &wide_nodes, std::vector<BVH8QNode> &quantized_nodes);
+template bool BVH::TraverseWide<BVH4Node, false>(const BVHRay &ray, BVHHitPoint &hit,
+                                                 const std::vector<BVH4Node> &wide_nodes);
+template bool BVH::TraverseWide<BVH4Node, true>(const BVHRay &ray, BVHHitPoint &hit,
+                                                const std::vector<BVH4Node> &wide_nodes);
+template bool BVH::TraverseWide<BVH8Node, false>(const BVHRay &ray, BVHHitPoint &hit,
+                                                 const std::vector<BVH8Node> &wide_nodes);
+template bool BVH::TraverseWide<BVH8Node, true>(const BVHRay &ray, BVHHitPoint &hit,
+                                                const std::vector<BVH8Node> &wide_nodes);
+template bool BVH::TraverseWide<BVH4QNode, false>(const BVHRay &ray, BVHHitPoint &hit,
+                                                  const std::vector<BVH4QNode> &wide_nodes);
+template bool BVH::TraverseWide<BVH4QNode, true>(const BVHRay &ray, BVHHitPoint &hit,
+                                                 const std::vector<BVH4QNode> &wide_nodes);
+template bool BVH::TraverseWide<BVH8QNode, false>(const BVHRay &ray, BVHHitPoint &hit,
+                                                  const std::vector<BVH8QNode> &wide_nodes);
+template bool BVH::TraverseWide<BVH8QNode, true>(const BVHRay &ray, BVHHitPoint &hit,
+                                                 const std::vector<BVH8QNode> &wide_nodes);
@@ -0,0 +1,551 @@
+#include "stdafx.h"
+#include "KDTree.h"
+
+#include <algorithm>
+#include <numeric>
+#include <iostream>
+#include <chrono>
+
+// candidate plane of the SAH sweep, at one position the ends come first, then the planar triangles, then the starts
+struct KDEvent {
+    float position;
+    int type;       // 0 end, 1 planar, 2 start
+
+    bool operator<(const KDEvent &other) const{
+        return position < other.position || (position == other.position && type < other.type);
+    }
+};
+
+KDTree::KDTree(std::vector<std::shared_ptr<BVHTriangle>> items, KDSettings settings) {
+    items_ = std::move(items);
+    settings_ = settings;
+}
+
+void KDTree::BuildTree() {
+    const int count = (int) items_.size();
+    nodes_.clear();
+    leaf_items_.clear();
+    bounds_ = BVHBbox::empty();
+    if(count == 0){
+        return;
+    }
+
+    auto t0 = std::chrono::high_resolution_clock::now();
+
+    for(const auto &item : items_){
+        bounds_.grow(item->get_bbox());
+    }
+    max_depth_ = settings_.max_depth > 0 ? settings_.max_depth : (int) (8 + 1.3f * log2f((float) count));
+
+    std::vector<int> refs(count);
+    std::iota(refs.begin(), refs.end(), 0);
+    std::shared_ptr<KDBuildNode> root;
+#pragma omp parallel
+#pragma omp single
+    root = BuildTree(refs, bounds_, 0);
+
+    FlattenTree(root);
+    root = nullptr;
+    BuildTriangleBuffer();
+
+    std::chrono::duration<float> duration = std::chrono::high_resolution_clock::now() - t0;
+    build_time_ = duration.count();
+    if(settings_.verbose){
+        std::cout << "k-d tree built in " << build_time_ << " seconds, " << nodes_.size() << " nodes, "
+                  << leaf_items_.size() << " references to " << count << " triangles, SAH cost " << SAHCost()
+                  << std::endl;
+    }
+}
+
+BVHBbox KDTree::ClipTriangle(int item, const BVHBbox &voxel) const {
+    // perfect splits: the planes come from the part of the triangle inside the voxel, not from its whole box
+    const BVHTriangle &triangle = *items_[item];
+    const BVHBbox &bbox = triangle.get_bbox();
+    if(bbox.border_min.x >= voxel.border_min.x && bbox.border_min.y >= voxel.border_min.y
+       && bbox.border_min.z >= voxel.border_min.z && bbox.border_max.x <= voxel.border_max.x
+       && bbox.border_max.y <= voxel.border_max.y && bbox.border_max.z <= voxel.border_max.z){
+        return bbox;
+    }
+
+    // Sutherland-Hodgman against the six voxel planes, every plane adds at most one vertex
+    Vector3 polygon[9];
+    Vector3 clipped[9];
+    int size = 3;
+    for(int i = 0; i < 3; i++){
+        polygon[i] = triangle.vertices_[i].position;
+    }
+    for(int axis = 0; axis < 3; axis++){
+        for(int side = 0; side < 2; side++){
+            const float plane = side ? voxel.border_max[axis] : voxel.border_min[axis];
+            int clipped_size = 0;
+            for(int i = 0; i < size; i++){
+                const Vector3 &a = polygon[i];
+                const Vector3 &b = polygon[(i + 1) % size];
+                const bool a_inside = side ? a[axis] <= plane : a[axis] >= plane;
+                const bool b_inside = side ? b[axis] <= plane : b[axis] >= plane;
+                if(a_inside){
+                    clipped[clipped_size++] = a;
+                }
+                if(a_inside != b_inside){
+                    const float t = (plane - a[axis]) / (b[axis] - a[axis]);
+                    Vector3 point = a + (b - a) * t;
+                    point[axis] = plane;
+                    clipped[clipped_size++] = point;
+                }
+            }
+            if(clipped_size == 0){
+                return BVHBbox::empty();
+            }
+            std::copy(clipped, clipped + clipped_size, polygon);
+            size = clipped_size;
+        }
+    }
+
+    // rounding of the intersection points may reach a little past the voxel
+    BVHBbox result = BVHBbox::empty();
+    for(int i = 0; i < size; i++){
+        result.grow(polygon[i]);
+    }
+    for(int axis = 0; axis < 3; axis++){
+        result.border_min[axis] = max(result.border_min[axis], voxel.border_min[axis]);
+        result.border_max[axis] = min(result.border_max[axis], voxel.border_max[axis]);
+    }
+    return result;
+}
+
+std::shared_ptr<KDBuildNode> KDTree::BuildTree(std::vector<int> &refs, const BVHBbox &voxel, int depth) {
+    auto node = std::make_shared<KDBuildNode>();
+    const float voxel_area = voxel.surface_area();
+    if(refs.empty() || depth >= max_depth_ || voxel_area <= 0){
+        node->items = std::move(refs);
+        return node;
+    }
+
+    // references whose clipped part vanished only touch the voxel border
+    std::vector<BVHBbox> clipped;
+    clipped.reserve(refs.size());
+    int valid = 0;
+    for(int ref : refs){
+        BVHBbox bounds = ClipTriangle(ref, voxel);
+        if(bounds.border_min.x <= bounds.border_max.x){
+            refs[valid++] = ref;
+            clipped.push_back(bounds);
+        }
+    }
+    refs.resize(valid);
+    const int count = valid;
+
+    float best_cost = settings_.intersection_cost * (float) count;
+    int best_axis = -1;
+    float best_split = 0;
+    bool best_planar_below = false;
+
+    std::vector<KDEvent> events;
+    events.reserve(2 * count);
+    for(int axis = 0; axis < 3; axis++){
+        events.clear();
+        for(const BVHBbox &bounds : clipped){
+            if(bounds.border_min[axis] == bounds.border_max[axis]){
+                events.push_back({bounds.border_min[axis], 1});
+            }
+            else{
+                events.push_back({bounds.border_min[axis], 2});
+                events.push_back({bounds.border_max[axis], 0});
+            }
+        }
+        std::sort(events.begin(), events.end());
+
+        // sweep the planes in order, below counts everything started so far, above everything not yet ended
+        int below = 0;
+        int above = count;
+        for(size_t e = 0; e < events.size();){
+            const float position = events[e].position;
+            int ends = 0;
+            int planar = 0;
+            int starts = 0;
+            for(; e < events.size() && events[e].position == position && events[e].type == 0; e++){
+                ends++;
+            }
+            for(; e < events.size() && events[e].position == position && events[e].type == 1; e++){
+                planar++;
+            }
+            for(; e < events.size() && events[e].position == position && events[e].type == 2; e++){
+                starts++;
+            }
+            above -= planar + ends;
+
+            // a plane on the voxel border leaves one child with no volume
+            if(position > voxel.border_min[axis] && position < voxel.border_max[axis]){
+                BVHBbox below_voxel = voxel;
+                BVHBbox above_voxel = voxel;
+                below_voxel.border_max[axis] = position;
+                above_voxel.border_min[axis] = position;
+                const float p_below = below_voxel.surface_area() / voxel_area;
+                const float p_above = above_voxel.surface_area() / voxel_area;
+
+                // triangles lying in the plane go to the side where they are cheaper
+                for(int planar_below = 0; planar_below < 2; planar_below++){
+                    const int n_below = below + (planar_below ? planar : 0);
+                    const int n_above = above + (planar_below ? 0 : planar);
+                    float cost = settings_.traversal_cost
+                                 + settings_.intersection_cost * (p_below * n_below + p_above * n_above);
+                    if(n_below == 0 || n_above == 0){
+                        cost *= 1 - settings_.empty_bonus;
+                    }
+                    if(cost < best_cost){
+                        best_cost = cost;
+                        best_axis = axis;
+                        best_split = position;
+                        best_planar_below = planar_below != 0;
+                    }
+                }
+            }
+            below += starts + planar;
+        }
+    }
+
+    if(best_axis < 0){
+        node->items = std::move(refs);
+        return node;
+    }
+
+    std::vector<int> below;
+    std::vector<int> above;
+    for(int i = 0; i < count; i++){
+        const float lo = clipped[i].border_min[best_axis];
+        const float hi = clipped[i].border_max[best_axis];
+        if(lo == best_split && hi == best_split){
+            (best_planar_below ? below : above).push_back(refs[i]);
+            continue;
+        }
+        if(lo < best_split){
+            below.push_back(refs[i]);
+        }
+        if(hi > best_split){
+            above.push_back(refs[i]);
+        }
+    }
+
+    // the reference lists of this level are not needed while the children are built
+    std::vector<BVHBbox>().swap(clipped);
+    std::vector<int>().swap(refs);
+
+    BVHBbox below_voxel = voxel;
+    BVHBbox above_voxel = voxel;
+    below_voxel.border_max[best_axis] = best_split;
+    above_voxel.border_min[best_axis] = best_split;
+
+    node->axis = best_axis;
+    node->split = best_split;
+#pragma omp task shared(node, below) if((int) below.size() > settings_.parallel_min_items)
+    node->children[0] = BuildTree(below, below_voxel, depth + 1);
+    node->children[1] = BuildTree(above, above_voxel, depth + 1);
+#pragma omp taskwait
+    return node;
+}
+
+int KDTree::FlattenTree(const std::shared_ptr<KDBuildNode> &node) {
+    const int index = (int) nodes_.size();
+    nodes_.emplace_back();
+    if(node->axis < 0){
+        nodes_[index].offset = (int) leaf_items_.size();
+        nodes_[index].flags = ((unsigned int) node->items.size() << 2) | 3u;
+        leaf_items_.insert(leaf_items_.end(), node->items.begin(), node->items.end());
+        return index;
+    }
+
+    FlattenTree(node->children[0]);
+    const int right = FlattenTree(node->children[1]);
+    nodes_[index].split = node->split;
+    nodes_[index].flags = ((unsigned int) right << 2) | (unsigned int) node->axis;
+    return index;
+}
+
+void KDTree::BuildTriangleBuffer() {
+    const int count = (int) items_.size();
+    triangles_.resize(count);
+    vertices_.resize(3 * count);
+    materials_.resize(count);
+    geom_ids_.resize(count);
+
+    for(int i = 0; i < count; i++){
+        const BVHTriangle &triangle = *items_[i];
+        triangles_.set(i, triangle.vertices_[0].position, triangle.vertices_[1].position,
+                       triangle.vertices_[2].position);
+        vertices_[3 * i] = triangle.vertices_[0];
+        vertices_[3 * i + 1] = triangle.vertices_[1];
+        vertices_[3 * i + 2] = triangle.vertices_[2];
+        materials_[i] = triangle.material;
+        geom_ids_[i] = triangle.geom_id;
+    }
+}
+
+void KDTree::Traverse(Ray &ray) {
+    BVHHitPoint hit;
+    hit.tfar = ray.get_tfar();
+    Intersect(BVHRay(ray), hit);
+    ResolveHit(hit);
+    hit.store(ray);
+}
+
+bool KDTree::Occluded(const Vector3 &origin, const Vector3 &direction, float tmax, float tnear) {
+    return Occluded(BVHRay(origin, direction, tnear), tmax);
+}
+
+void KDTree::Intersect(const BVHRay &ray, BVHHitPoint &hit) {
+    TraverseTree<false>(ray, hit);
+}
+
+bool KDTree::Occluded(const BVHRay &ray, float tmax) {
+    BVHHitPoint hit;
+    hit.tfar = tmax;
+    return TraverseTree<true>(ray, hit);
+}
+
+void KDTree::ResolveHit(BVHHitPoint &hit) const {
+    if(hit.prim_id < 0){
+        return;
+    }
+
+    const Vertex *v = &vertices_[3 * hit.prim_id];
+    const float w = 1 - hit.u - hit.v;
+    hit.normal = v[0].normal * w + v[1].normal * hit.u + v[2].normal * hit.v;
+    hit.text_coords.u = v[0].texture_coords[0].u * w + v[1].texture_coords[0].u * hit.u
+                        + v[2].texture_coords[0].u * hit.v;
+    hit.text_coords.v = v[0].texture_coords[0].v * w + v[1].texture_coords[0].v * hit.u
+                        + v[2].texture_coords[0].v * hit.v;
+    hit.material = materials_[hit.prim_id];
+    hit.geom_id = geom_ids_[hit.prim_id];
+    hit.is_intersected = true;
+}
+
+static bool ClipRay(const BVHBbox &bbox, const BVHRay &ray, float tfar, float &tmin, float &tmax) {
+    // the slab test of BVHBbox::is_intersecting, the exit distance is needed here as well
+    float tx0 = ((ray.sign[0] ? bbox.border_max.x : bbox.border_min.x) - ray.origin.x) * ray.inv_direction.x;
+    float tx1 = ((ray.sign[0] ? bbox.border_min.x : bbox.border_max.x) - ray.origin.x) * ray.inv_direction.x;
+    float ty0 = ((ray.sign[1] ? bbox.border_max.y : bbox.border_min.y) - ray.origin.y) * ray.inv_direction.y;
+    float ty1 = ((ray.sign[1] ? bbox.border_min.y : bbox.border_max.y) - ray.origin.y) * ray.inv_direction.y;
+    float tz0 = ((ray.sign[2] ? bbox.border_max.z : bbox.border_min.z) - ray.origin.z) * ray.inv_direction.z;
+    float tz1 = ((ray.sign[2] ? bbox.border_min.z : bbox.border_max.z) - ray.origin.z) * ray.inv_direction.z;
+
+    tmin = max(max(tx0, ty0), max(tz0, ray.tnear));
+    tmax = min(min(tx1, ty1), min(tz1, tfar));
+    return tmin <= tmax;
+}
+
+template <bool ANY_HIT>
+bool KDTree::TraverseTree(const BVHRay &ray, BVHHitPoint &hit) {
+    float scene_tmin, scene_tmax;
+    if(nodes_.empty() || !ClipRay(bounds_, ray, hit.tfar, scene_tmin, scene_tmax)){
+        return false;
+    }
+
+    // far children wait in a ring, a push onto a full one drops the farthest entry
+    struct StackEntry {
+        int node;
+        float tmin;
+        float tmax;
+    };
+    StackEntry stack[KD_SHORT_STACK_SIZE];
+    int stack_top = 0;
+    int stack_size = 0;
+
+    // dropped entries are found again by restarting behind the last leaf, from the deepest node that still
+    // holds the whole rest of the ray instead of from the root
+    int restart = 0;
+    bool push_down = true;
+
+    int visited = 0;
+    int node_index = 0;
+    float tmin = scene_tmin;
+    float tmax = scene_tmax;
+    while(true){
+        const KDNode *node = &nodes_[node_index];
+        while(!node->is_leaf()){
+            visited++;
+            const int axis = node->axis();
+            const float origin = ray.origin[axis];
+            const float t_split = (node->split - origin) * ray.inv_direction[axis];
+            const bool below_first = origin < node->split || (origin == node->split && ray.direction[axis] <= 0);
+            const int near_index = below_first ? node_index + 1 : node->right();
+            const int far_index = below_first ? node->right() : node_index + 1;
+
+            // NaN when the ray runs inside the plane, it stays on the near side, as does a ray leaving the plane
+            if(t_split > tmax || t_split <= 0 || t_split != t_split){
+                node_index = near_index;
+            }
+            else if(t_split <= tmin){
+                node_index = far_index;
+            }
+            else{
+                stack[stack_top] = {far_index, t_split, tmax};
+                stack_top = (stack_top + 1) % KD_SHORT_STACK_SIZE;
+                stack_size = min(stack_size + 1, KD_SHORT_STACK_SIZE);
+                node_index = near_index;
+                tmax = t_split;
+                push_down = false;
+            }
+            if(push_down){
+                restart = node_index;
+            }
+            node = &nodes_[node_index];
+        }
+
+        visited++;
+        for(int i = node->offset; i < node->offset + node->count(); i++){
+            const int item = leaf_items_[i];
+            float dist, u, v;
+            if(triangles_.intersect(item, ray, dist, u, v) && dist > ray.tnear && dist < hit.tfar){
+                if(ANY_HIT){
+                    RecordStats(hit, visited);
+                    return true;
+                }
+                hit.tfar = dist;
+                hit.u = u;
+                hit.v = v;
+                hit.prim_id = item;
+            }
+        }
+
+        // the voxels behind this leaf can not hold anything closer
+        if(hit.tfar <= tmax){
+            break;
+        }
+
+        if(stack_size > 0){
+            stack_top = (stack_top + KD_SHORT_STACK_SIZE - 1) % KD_SHORT_STACK_SIZE;
+            stack_size--;
+            node_index = stack[stack_top].node;
+            tmin = stack[stack_top].tmin;
+            tmax = stack[stack_top].tmax;
+            if(tmin > hit.tfar){
+                break;
+            }
+        }
+        else{
+            if(tmax >= scene_tmax){
+                break;
+            }
+            node_index = restart;
+            tmin = tmax;
+            tmax = scene_tmax;
+            push_down = true;
+        }
+    }
+
+    RecordStats(hit, visited);
+    return hit.prim_id >= 0;
+}
+
+template bool KDTree::TraverseTree<false>(const BVHRay &ray, BVHHitPoint &hit);
+template bool KDTree::TraverseTree<true>(const BVHRay &ray, BVHHitPoint &hit);
+
+void KDTree::RecordStats(BVHHitPoint &hit, int visited) {
+    hit.visited_nodes += visited;
+    if(BVH::COLLECT_STATS){
+        stats_rays_.fetch_add(1, std::memory_order_relaxed);
+        stats_nodes_.fetch_add(visited, std::memory_order_relaxed);
+    }
+}
+
+float KDTree::AverageVisitedNodes() const {
+    long long rays = stats_rays_.load(std::memory_order_relaxed);
+    if(rays == 0){
+        return 0;
+    }
+    return (float) stats_nodes_.load(std::memory_order_relaxed) / (float) rays;
+}
+
+void KDTree::ResetStats() {
+    stats_rays_.store(0, std::memory_order_relaxed);
+    stats_nodes_.store(0, std::memory_order_relaxed);
+}
+
+BVHBbox KDTree::Bounds() const {
+    return nodes_.empty() ? BVHBbox::empty() : bounds_;
+}
+
+float KDTree::BuildTime() const {
+    return build_time_;
+}
+
+float KDTree::SAHCost() const {
+    return Report().sah_cost;
+}
+
+KDReport KDTree::Report() const {
+    KDReport report;
+    report.node_count = (int) nodes_.size();
+    report.reference_count = (int) leaf_items_.size();
+    report.triangle_count = (int) items_.size();
+    report.build_time = build_time_;
+    report.node_bytes = nodes_.size() * sizeof(KDNode);
+    report.triangle_bytes = triangles_.size() * 9 * sizeof(float) + vertices_.size() * sizeof(Vertex)
+                            + materials_.size() * sizeof(Material *) + leaf_items_.size() * sizeof(int);
+    const float root_area = bounds_.surface_area();
+    if(nodes_.empty() || root_area <= 0){
+        return report;
+    }
+
+    // the voxels are not stored, they are cut out of the scene box on the way down
+    struct StackEntry {
+        int node;
+        int depth;
+        BVHBbox voxel;
+    };
+    std::vector<StackEntry> stack(1, StackEntry{0, 0, bounds_});
+    double cost = 0;
+    while(!stack.empty()){
+        const StackEntry entry = stack.back();
+        stack.pop_back();
+        const KDNode &node = nodes_[entry.node];
+        const float area = entry.voxel.surface_area() / root_area;
+
+        if(node.is_leaf()){
+            report.leaf_count++;
+            report.empty_leaf_count += node.count() == 0;
+            report.max_depth = max(report.max_depth, entry.depth);
+            cost += settings_.intersection_cost * node.count() * area;
+            continue;
+        }
+
+        cost += settings_.traversal_cost * area;
+        StackEntry below{entry.node + 1, entry.depth + 1, entry.voxel};
+        StackEntry above{node.right(), entry.depth + 1, entry.voxel};
+        below.voxel.border_max[node.axis()] = node.split;
+        above.voxel.border_min[node.axis()] = node.split;
+        stack.push_back(above);
+        stack.push_back(below);
+    }
+    report.sah_cost = (float) cost;
+    return report;
+}
+
+float KDTree::RaysPerSecond() {
+    // best of a few passes, one pass of a small sample is easily disturbed by the other threads
+    const std::vector<Ray> sample = BVH::RandomRays(Bounds(), settings_.speed_rays);
+    float best = FLT_MAX;
+    for(int pass = 0; pass < settings_.speed_passes; pass++){
+        std::vector<Ray> rays = sample;
+        auto t0 = std::chrono::high_resolution_clock::now();
+        for(Ray &ray : rays){
+            Traverse(ray);
+        }
+        std::chrono::duration<float> duration = std::chrono::high_resolution_clock::now() - t0;
+        best = min(best, duration.count());
+    }
+    ResetStats();
+    return best > 0 && best < FLT_MAX ? sample.size() / best : 0;
+}
+
+void KDReport::Print() const {
+    std::cout << "k-d tree report: " << node_count << " nodes, " << leaf_count << " leaves (" << empty_leaf_count
+              << " empty), " << reference_count << " references to " << triangle_count << " triangles" << std::endl;
+    std::cout << "  SAH cost " << sah_cost << ", depth max " << max_depth << ", built in " << build_time
+              << " seconds" << std::endl;
+    std::cout << "  memory " << (node_bytes + triangle_bytes) / 1024 << " KB (nodes " << node_bytes / 1024
+              << " KB, triangles " << triangle_bytes / 1024 << " KB)" << std::endl;
+    if(rays_per_second > 0){
+        std::cout << "  traversal " << rays_per_second * 1e-6f << " Mrays/s over random rays" << std::endl;
+    }
+}
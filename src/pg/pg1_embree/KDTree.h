@@ -0,0 +1,137 @@
+#ifndef PG1_KDTREE_H
+#define PG1_KDTREE_H
+
+#include "BVH.h"
+#include <vector>
+#include <memory>
+#include <atomic>
+
+/*! \def KD_SHORT_STACK_SIZE
+\brief Entries of the k-d tree traversal stack, the oldest ones are dropped and found again by a restart.
+*/
+#define KD_SHORT_STACK_SIZE 8
+
+struct KDSettings{
+    float traversal_cost = 1.0f;    // cost of one node visit relative to one triangle test
+    float intersection_cost = 1.5f;
+    float empty_bonus = 0.2f;       // a split with an empty side is this much cheaper, cuts off empty space early
+    int max_depth = 0;              // 0 picks 8 + 1.3 log2(triangles)
+    int parallel_min_items = 4096;  // subtrees with more references are built in their own OpenMP task
+    bool verbose = true;            // BuildTree prints its time, size and SAH cost
+    int speed_rays = 16384;         // RaysPerSecond: random rays of the sample, as BVHSettings::tune_random_rays
+    int speed_passes = 3;           // RaysPerSecond: the sample is traced this often, the best pass counts
+};
+
+// node of the build, children[0] is below the plane
+class KDBuildNode {
+public:
+    int axis = -1;              // -1 for a leaf
+    float split = 0;
+    std::vector<int> items;     // leaf only
+    std::shared_ptr<KDBuildNode> children[2];
+};
+
+// node of the compiled tree, the child below the plane always follows its parent in the array
+struct KDNode {
+    union {
+        float split;            // interior: plane position
+        int offset;             // leaf: first entry of leaf_items_
+    };
+    unsigned int flags;         // bits 0-1: axis, 3 for a leaf, bits 2-31: interior right child, leaf item count
+
+    bool is_leaf() const{
+        return (flags & 3) == 3;
+    }
+
+    int axis() const{
+        return (int) (flags & 3);
+    }
+
+    int right() const{
+        return (int) (flags >> 2);
+    }
+
+    int count() const{
+        return (int) (flags >> 2);
+    }
+};
+
+static_assert(sizeof(KDNode) == 8, "KDNode should fit eight nodes into a cache line");
+
+// size and cost of a built tree, printed next to the BVH report
+struct KDReport {
+    int node_count = 0;
+    int leaf_count = 0;
+    int empty_leaf_count = 0;
+    int reference_count = 0;        // triangles in the leaves, straddling ones are referenced from both sides
+    int triangle_count = 0;
+    int max_depth = 0;
+    float sah_cost = 0;
+    float build_time = 0;
+    size_t node_bytes = 0;
+    size_t triangle_bytes = 0;      // intersection buffer, hit data and leaf_items_
+    float rays_per_second = 0;      // random rays timed by RaysPerSecond, 0 when not measured
+
+    void Print() const;
+};
+
+// SAH k-d tree with perfect splits, an alternative to BVH over the same triangles and with the same queries
+class KDTree {
+public:
+    explicit KDTree(std::vector<std::shared_ptr<BVHTriangle>> items, KDSettings settings = KDSettings());
+
+    void BuildTree();
+    void Traverse(Ray &ray);
+
+    // any hit in (tnear, tmax), stops at the first one and writes no hit attributes
+    bool Occluded(const Vector3 &origin, const Vector3 &direction, float tmax, float tnear = 0.001f);
+
+    void Intersect(const BVHRay &ray, BVHHitPoint &hit);
+    bool Occluded(const BVHRay &ray, float tmax);
+    void ResolveHit(BVHHitPoint &hit) const;
+
+    // world box of the whole tree, empty before BuildTree
+    BVHBbox Bounds() const;
+
+    // expected cost of one ray (in triangle tests), matches BVH::SAHCost only when both use the same costs
+    float SAHCost() const;
+    float BuildTime() const;
+    KDReport Report() const;
+
+    // closest hit rate over random rays, timed the same way as BVH::RaysPerSecond
+    float RaysPerSecond();
+
+    // average number of visited nodes per traversed ray, counted only with BVH::COLLECT_STATS
+    float AverageVisitedNodes() const;
+    void ResetStats();
+
+private:
+    std::vector<KDNode> nodes_;
+    std::vector<std::shared_ptr<BVHTriangle>> items_;
+    std::vector<int> leaf_items_;       // leaves span index ranges of it
+    BVHBbox bounds_;
+    KDSettings settings_;
+
+    // intersection data and hit data in item order, leaves reach them through leaf_items_
+    BVHTriangleBuffer triangles_;
+    std::vector<Vertex> vertices_;
+    std::vector<Material*> materials_;
+    std::vector<unsigned int> geom_ids_;
+
+    float build_time_ = 0;
+    int max_depth_ = 0;
+
+    std::atomic<long long> stats_rays_{0};
+    std::atomic<long long> stats_nodes_{0};
+
+    std::shared_ptr<KDBuildNode> BuildTree(std::vector<int> &refs, const BVHBbox &voxel, int depth);
+    BVHBbox ClipTriangle(int item, const BVHBbox &voxel) const;
+    int FlattenTree(const std::shared_ptr<KDBuildNode> &node);
+    void BuildTriangleBuffer();
+
+    template <bool ANY_HIT> bool TraverseTree(const BVHRay &ray, BVHHitPoint &hit);
+    void RecordStats(BVHHitPoint &hit, int visited);
+};
+
+
+#endif //PG1_KDTREE_H
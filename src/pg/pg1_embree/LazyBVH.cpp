@@ -0,0 +1,186 @@
+#include "stdafx.h"
+#include "LazyBVH.h"
+
+#include <algorithm>
+#include <utility>
+#include <chrono>
+#include <iostream>
+
+LazyBVH::LazyBVH(std::vector<std::shared_ptr<BVHTriangle>> items, BVHSettings settings)
+        : items_(std::move(items)), settings_(settings) {
+}
+
+void LazyBVH::BuildTree() {
+    nodes_.clear();
+    subtrees_.clear();
+    built_subtrees_.store(0);
+    if(items_.empty()){
+        return;
+    }
+
+    auto t0 = std::chrono::high_resolution_clock::now();
+    const int count = (int) items_.size();
+    std::vector<int> order(count);
+    std::vector<BVHBbox> bounds(count);
+    std::vector<Vector3> centroids(count);
+#pragma omp parallel for
+    for(int i = 0; i < count; i++){
+        order[i] = i;
+        bounds[i] = items_[i]->get_bbox();
+        centroids[i] = bounds[i].get_center();
+    }
+    BuildTree(order, bounds, centroids, 0, count);
+
+    std::chrono::duration<float> duration = std::chrono::high_resolution_clock::now() - t0;
+    if(settings_.verbose){
+        std::cout << "Lazy BVH top levels built in " << duration.count() << " seconds, " << nodes_.size()
+                  << " nodes, " << subtrees_.size() << " subtrees left for the first rays" << std::endl;
+    }
+}
+
+int LazyBVH::BuildTree(std::vector<int> &order, const std::vector<BVHBbox> &item_bounds,
+                       const std::vector<Vector3> &centroids, int from, int to) {
+    BVHBbox bounds = BVHBbox::empty();
+    BVHBbox centroid_bounds = BVHBbox::empty();
+    for(int i = from; i < to; i++){
+        bounds.grow(item_bounds[order[i]]);
+        centroid_bounds.grow(centroids[order[i]]);
+    }
+
+    const int index = (int) nodes_.size();
+    nodes_.push_back(BVHFlatNode{bounds, 0, 0});
+    if(to - from <= max(settings_.lazy_subtree_items, 1)){
+        auto subtree = std::make_unique<LazySubtree>();
+        for(int i = from; i < to; i++){
+            subtree->items.push_back(items_[order[i]]);
+        }
+        nodes_[index].offset = (int) subtrees_.size();
+        nodes_[index].count = to - from;
+        subtrees_.push_back(std::move(subtree));
+        return index;
+    }
+
+    // the top levels only sort triangles into regions, an object median along the widest centroid axis is
+    // cheap and the subtrees get the real builder
+    Vector3 extent = centroid_bounds.border_max - centroid_bounds.border_min;
+    int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    const int pivot = (from + to) / 2;
+    std::nth_element(order.begin() + from, order.begin() + pivot, order.begin() + to,
+                     [&](int a, int b) {
+                         return centroids[a][axis] < centroids[b][axis];
+                     });
+
+    BuildTree(order, item_bounds, centroids, from, pivot);
+    const int right = BuildTree(order, item_bounds, centroids, pivot, to);
+    nodes_[index].offset = right;
+    return index;
+}
+
+BVH &LazyBVH::Expand(LazySubtree &subtree) {
+    std::call_once(subtree.built, [&]() {
+        BVHSettings settings = settings_;
+        settings.verbose = false;
+        auto bvh = std::make_unique<BVH>(std::move(subtree.items), settings);
+        bvh->BuildTree();
+        subtree.bvh = std::move(bvh);
+        built_subtrees_.fetch_add(1, std::memory_order_relaxed);
+    });
+    return *subtree.bvh;
+}
+
+template <bool ANY_HIT>
+bool LazyBVH::TraverseTree(const BVHRay &ray, BVHHitPoint &hit) {
+    int stack[BVH_STACK_SIZE];
+    float stack_tmin[BVH_STACK_SIZE];
+    int stack_size = 0;
+
+    float tmin;
+    int node_index = nodes_[0].bbox.is_intersecting(ray, hit.tfar, tmin) ? 0 : -1;
+    BVH *owner = nullptr;
+
+    while(node_index >= 0){
+        const int current = node_index;
+        const BVHFlatNode &node = nodes_[current];
+        node_index = -1;
+
+        if(node.is_leaf()){
+            BVH &bvh = Expand(*subtrees_[node.offset]);
+            if(ANY_HIT){
+                if(bvh.Occluded(ray, hit.tfar)){
+                    return true;
+                }
+            }
+            else{
+                const float tfar = hit.tfar;
+                bvh.Intersect(ray, hit);
+                if(hit.tfar < tfar){
+                    owner = &bvh;
+                }
+            }
+        } else {
+            int near_index = current + 1;
+            int far_index = node.offset;
+            float t_near, t_far;
+            bool hit_near = nodes_[near_index].bbox.is_intersecting(ray, hit.tfar, t_near);
+            bool hit_far = nodes_[far_index].bbox.is_intersecting(ray, hit.tfar, t_far);
+
+            if(hit_near && hit_far){
+                if(t_far < t_near){
+                    std::swap(near_index, far_index);
+                    std::swap(t_near, t_far);
+                }
+                stack[stack_size] = far_index;
+                stack_tmin[stack_size] = t_far;
+                stack_size++;
+                node_index = near_index;
+            }
+            else if(hit_near){
+                node_index = near_index;
+            }
+            else if(hit_far){
+                node_index = far_index;
+            }
+        }
+
+        while(node_index < 0 && stack_size > 0){
+            stack_size--;
+            if(stack_tmin[stack_size] <= hit.tfar){
+                node_index = stack[stack_size];
+            }
+        }
+    }
+
+    // only the subtree with the closest hit interpolates
+    if(owner){
+        owner->ResolveHit(hit);
+        return true;
+    }
+    return false;
+}
+
+void LazyBVH::Traverse(Ray &ray) {
+    if(nodes_.empty()){
+        return;
+    }
+    BVHHitPoint hit;
+    hit.tfar = ray.get_tfar();
+    TraverseTree<false>(BVHRay(ray), hit);
+    hit.store(ray);
+}
+
+bool LazyBVH::Occluded(const Vector3 &origin, const Vector3 &direction, float tmax, float tnear) {
+    if(nodes_.empty()){
+        return false;
+    }
+    BVHHitPoint hit;
+    hit.tfar = tmax;
+    return TraverseTree<true>(BVHRay(origin, direction, tnear), hit);
+}
+
+int LazyBVH::SubtreeCount() const {
+    return (int) subtrees_.size();
+}
+
+int LazyBVH::BuiltSubtreeCount() const {
+    return built_subtrees_.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,49 @@
+#ifndef PG1_LAZYBVH_H
+#define PG1_LAZYBVH_H
+
+#include "BVH.h"
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+
+// triangles under one top-level leaf, their tree is built by the first ray that reaches the leaf
+struct LazySubtree {
+    std::vector<std::shared_ptr<BVHTriangle>> items;   // handed over to the tree once it is built
+    std::unique_ptr<BVH> bvh;
+    std::once_flag built;
+};
+
+// BVH whose top levels are built right away and whose subtrees are built on demand, parts of the scene no ray
+// reaches are never built, so the first image of a large scene appears sooner
+class LazyBVH {
+public:
+    explicit LazyBVH(std::vector<std::shared_ptr<BVHTriangle>> items, BVHSettings settings = BVHSettings());
+
+    // builds only the top levels, down to leaves of at most BVHSettings::lazy_subtree_items triangles
+    void BuildTree();
+    void Traverse(Ray &ray);
+    bool Occluded(const Vector3 &origin, const Vector3 &direction, float tmax, float tnear = 0.001f);
+
+    int SubtreeCount() const;
+    int BuiltSubtreeCount() const;
+
+private:
+    std::vector<std::shared_ptr<BVHTriangle>> items_;
+    std::vector<BVHFlatNode> nodes_;        // leaves index subtrees_, the top level never changes after BuildTree
+    std::vector<std::unique_ptr<LazySubtree>> subtrees_;
+    BVHSettings settings_;
+
+    std::atomic<int> built_subtrees_{0};
+
+    int BuildTree(std::vector<int> &order, const std::vector<BVHBbox> &item_bounds,
+                  const std::vector<Vector3> &centroids, int from, int to);
+
+    // thread safe, every subtree is built exactly once and the other threads reaching it wait for it
+    BVH &Expand(LazySubtree &subtree);
+
+    template <bool ANY_HIT> bool TraverseTree(const BVHRay &ray, BVHHitPoint &hit);
+};
+
+
+#endif //PG1_LAZYBVH_H
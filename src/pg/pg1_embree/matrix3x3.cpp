@@ -51,6 +51,21 @@ Matrix3x3 Matrix3x3::Transpose() const
 		m02_, m12_, m22_ );
 }
 
+Matrix3x3 Matrix3x3::Inverse() const
+{
+	const float c00 = m11_ * m22_ - m12_ * m21_;
+	const float c01 = m12_ * m20_ - m10_ * m22_;
+	const float c02 = m10_ * m21_ - m11_ * m20_;
+
+	const float det = m00_ * c00 + m01_ * c01 + m02_ * c02;
+	assert( det != 0.0f );
+	const float inv_det = 1.0f / det;
+
+	return Matrix3x3( c00 * inv_det, ( m02_ * m21_ - m01_ * m22_ ) * inv_det, ( m01_ * m12_ - m02_ * m11_ ) * inv_det,
+		c01 * inv_det, ( m00_ * m22_ - m02_ * m20_ ) * inv_det, ( m02_ * m10_ - m00_ * m12_ ) * inv_det,
+		c02 * inv_det, ( m01_ * m20_ - m00_ * m21_ ) * inv_det, ( m00_ * m11_ - m01_ * m10_ ) * inv_det );
+}
+
 void Matrix3x3::set( const int row, const int column, const float value )
 {
 	assert( row >= 0 && row < 3 && column >= 0 && column < 3 );
@@ -34,6 +34,12 @@ public:
 	Provede traspozici matice vzjemnou vmnou dk a sloupc.
 	*/
 	Matrix3x3 Transpose() const;
+
+	//! Inverze matice.
+	/*!
+	Vypote inverzn matici pomoc adjungovan matice, matice mus bt regulrn.
+	*/
+	Matrix3x3 Inverse() const;
 	
 	//! Nastav zadan prvek matice na novou hodnotu.
 	/*!
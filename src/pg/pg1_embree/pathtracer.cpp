@@ -54,11 +54,15 @@ void Pathtracer::LoadScene(const std::string file_name)
 {
 	const int no_surfaces = LoadOBJ(file_name.c_str(), surfaces_, materials_);
 
-    std::vector<std::shared_ptr<BVHTriangle>> bvh_triangles;
+    std::vector<std::shared_ptr<BVHTriangle>> &bvh_triangles = accelerator_scene_.triangles;
+    bvh_triangles.clear();
+    accelerator_scene_.surface_offsets.clear();
 
 	// surfaces loop
 	for (auto surface : surfaces_)
 	{
+        accelerator_scene_.surface_offsets.push_back((int) bvh_triangles.size());
+
 		RTCGeometry mesh = rtcNewGeometry(device_, RTC_GEOMETRY_TYPE_TRIANGLE);
 
 		Vertex3f* vertices = (Vertex3f*)rtcSetNewGeometryBuffer(
@@ -127,12 +131,28 @@ void Pathtracer::LoadScene(const std::string file_name)
 		rtcReleaseGeometry(mesh);
 	} // end of surfaces loop
 
-    bvh_ = std::make_unique<BVH>(bvh_triangles);
-    bvh_->BuildTree();
-
     TriangleLight::calculate_cdf(lights_);
 
 	rtcCommitScene(scene_);
+
+    accelerator_scene_.scene = scene_;
+
+    // every 4th pixel of the camera, BVHAutoTune times its candidate trees on them
+    accelerator_scene_.camera_rays.clear();
+    for (int y = 0; y < height(); y += 4) {
+        for (int x = 0; x < width(); x += 4) {
+            accelerator_scene_.camera_rays.push_back(camera_.GenerateRay(x + 0.5f, y + 0.5f));
+        }
+    }
+    accelerator_ = Accelerator::Create(accelerator_type_, accelerator_scene_);
+}
+
+void Pathtracer::SetAccelerator(const AcceleratorType type)
+{
+    accelerator_type_ = type;
+    if(accelerator_){
+        accelerator_ = Accelerator::Create(accelerator_type_, accelerator_scene_);
+    }
 }
 
 int Pathtracer::Ui()
@@ -146,6 +166,13 @@ int Pathtracer::Ui()
     ImGui::Text("Materials = %d", materials_.size());
     ImGui::Separator();
     ImGui::Checkbox("Vsync", &vsync_);
+    ImGui::Checkbox("BVH stats", &BVH::COLLECT_STATS);
+    if(accelerator_){
+        ImGui::Text("Accelerator = %s", accelerator_->Name());
+    }
+    if(BVH::COLLECT_STATS && accelerator_ && accelerator_->AverageVisitedNodes() >= 0){
+        ImGui::Text("%s nodes/ray = %.1f", accelerator_->Name(), accelerator_->AverageVisitedNodes());
+    }
 
     ImGui::SliderFloat("float", &f, 0.0f, 1.0f); // Edit 1 float using a slider from 0.0f to 1.0f
     //ImGui::ColorEdit3( "clear color", ( float* )&clear_color ); // Edit 3 floats representing a color
@@ -175,19 +202,19 @@ int Pathtracer::Ui()
     return 0;
 }
 
-bool Pathtracer::is_visible(const Vector3 hit_point, const Vector3 light_point){
+ShadowRay Pathtracer::make_shadow_ray(const Vector3 hit_point, const Vector3 light_point){
 
     // vector to light
-    Vector3 l = light_point - hit_point;
-    float dist = l.L2Norm();
+    ShadowRay shadow_ray;
+    shadow_ray.origin = hit_point;
+    shadow_ray.direction = light_point - hit_point;
+    shadow_ray.tmax = shadow_ray.direction.L2Norm();
 
-    l *= 1.0f / dist;
+    shadow_ray.direction *= 1.0f / shadow_ray.tmax;
 
     // to avoid self-shadowing
-    Ray ray(hit_point, l, 0.001f);
-    ray.set_tfar(dist);
-    ray.intersect(scene_);
-    return !ray.has_hit();
+    shadow_ray.tnear = 0.001f;
+    return shadow_ray;
 }
 
 void Pathtracer::LoadBackground() {
@@ -198,23 +225,22 @@ Ray Pathtracer::make_secondary_ray(const Vector3& origin, const Vector3& dir, co
     return Ray{origin, dir, 0.01f, ior};
 }
 
-Color4f Pathtracer::get_pixel(const int x, const int y, const float t)
+void Pathtracer::generate_pixel_rays(const int x, const int y, std::vector<Ray> &rays)
 {
     int sample_count = 10;
-    int total_samples = sample_count * sample_count;
 
-    Vector3 acc = {0, 0, 0};
     for (int i = 0; i < sample_count; i++) {
         for (int j = 0; j < sample_count; j++) {
             float x_in = x + i * (1.0 / sample_count) + Random() / sample_count;
             float y_in = y + j * (1.0 / sample_count) + Random() / sample_count;
 
-            Ray ray(this->camera_.GenerateRay((float)x_in, (float)y_in));
-            Vector3 result = trace(ray, 0);
-            acc += result;
+            rays.push_back(this->camera_.GenerateRay((float)x_in, (float)y_in));
         }
     }
+}
 
+Color4f Pathtracer::accumulate_pixel(const int x, const int y, const Vector3 acc, const int total_samples)
+{
     float * data = buffer_data + (y * width_ + x) * 3;
     Vector3 buffered_color = {data[0], data[1], data[2]};
     buffered_color += acc;
@@ -231,23 +257,120 @@ Color4f Pathtracer::get_pixel(const int x, const int y, const float t)
     return static_cast<Color4f>(final_color);
 }
 
+Color4f Pathtracer::get_pixel(const int x, const int y, const float t)
+{
+    std::vector<Ray> rays;
+    generate_pixel_rays(x, y, rays);
+    const int total_samples = (int) rays.size();
 
-Vector3 Pathtracer::trace(Ray &ray, const int depth = 0) {
-    if(depth >= 10){
-        return {0, 0, 0};
+    Vector3 acc = {0, 0, 0};
+    for(const Vector3 &radiance : trace_paths(rays)){
+        acc += radiance;
     }
+    return accumulate_pixel(x, y, acc, total_samples);
+}
 
-    ray.intersect(scene_);
-    if(Ray::BVH_BOOL){
-        bvh_->Traverse(ray);
+void Pathtracer::get_tile(const int x0, const int y0, const int w, const int h, const float t, float *pixels)
+{
+    // the paths of the whole tile advance together, so every bounce is one batch of thousands of rays
+    std::vector<Ray> tile_rays;
+    std::vector<size_t> pixel_starts;
+    for (int y = y0; y < y0 + h; y++) {
+        for (int x = x0; x < x0 + w; x++) {
+            pixel_starts.push_back(tile_rays.size());
+            generate_pixel_rays(x, y, tile_rays);
+        }
     }
+    pixel_starts.push_back(tile_rays.size());
 
+    const std::vector<Vector3> results = trace_paths(tile_rays);
+    for (size_t pixel = 0; pixel + 1 < pixel_starts.size(); pixel++) {
+        Vector3 acc = {0, 0, 0};
+        for (size_t i = pixel_starts[pixel]; i < pixel_starts[pixel + 1]; i++) {
+            acc += results[i];
+        }
+
+        const Color4f color = accumulate_pixel(x0 + (int) pixel % w, y0 + (int) pixel / w, acc,
+                                               (int) (pixel_starts[pixel + 1] - pixel_starts[pixel]));
+        pixels[pixel * 4] = color.r;
+        pixels[pixel * 4 + 1] = color.g;
+        pixels[pixel * 4 + 2] = color.b;
+        pixels[pixel * 4 + 3] = color.a;
+    }
+}
+
+std::vector<Vector3> Pathtracer::trace_paths(std::vector<Ray> &rays) {
+    const int path_count = (int) rays.size();
+    std::vector<Vector3> radiance(path_count, Vector3(0, 0, 0));
+    std::vector<Vector3> throughput(path_count, Vector3(1, 1, 1));
+    std::vector<char> skip_light(path_count, 0);
+    std::vector<int> paths(path_count);
+    for(int i = 0; i < path_count; i++){
+        paths[i] = i;
+    }
+
+    // every bounce reuses the buffers, rays and next_rays swap roles
+    std::vector<Ray> next_rays;
+    std::vector<int> next_paths;
+    std::vector<PathVertex> vertices;
+    std::vector<ShadowRay> shadow_rays;
+
+    for(int depth = 0; depth < 10 && !rays.empty(); depth++){
+        // camera rays are coherent, the bounces are not
+        if(depth == 0){
+            accelerator_->IntersectTile(rays.data(), (int) rays.size());
+        }
+        else{
+            accelerator_->IntersectBatch(rays.data(), (int) rays.size());
+        }
+
+        // the light samples of all vertices are answered by one query
+        vertices.resize(rays.size());
+        shadow_rays.clear();
+        for(size_t i = 0; i < rays.size(); i++){
+            vertices[i] = scatter(rays[i]);
+            if(vertices[i].has_light_sample){
+                shadow_rays.push_back(vertices[i].light_ray);
+            }
+        }
+        accelerator_->OccludedBatch(shadow_rays.data(), (int) shadow_rays.size());
+
+        next_rays.clear();
+        next_paths.clear();
+        int shadow_ray = 0;
+        for(size_t i = 0; i < rays.size(); i++){
+            PathVertex &vertex = vertices[i];
+            const int path = paths[i];
+            if(vertex.has_light_sample){
+                resolve_light_sample(vertex, shadow_rays[shadow_ray++].occluded);
+            }
+
+            // a light already sampled at the previous vertex is not counted again when the path hits it
+            if(!(skip_light[path] && rays[i].nne_has_hit_light)){
+                radiance[path] += throughput[path] * vertex.emitted;
+            }
+            if(vertex.has_next){
+                throughput[path] = throughput[path] * vertex.weight;
+                skip_light[path] = vertex.skip_light;
+                next_rays.push_back(vertex.next);
+                next_paths.push_back(path);
+            }
+        }
+        rays.swap(next_rays);
+        paths.swap(next_paths);
+    }
+    return radiance;
+}
+
+PathVertex Pathtracer::scatter(Ray &ray) {
+    PathVertex vertex;
     if(!ray.has_hit()){
         Vector3 ray_dir = ray.get_direction();
         //Color3f bg_color = background_->texel(ray_dir.x, ray_dir.y, ray_dir.z);
-        //return {bg_color};
-//        return {0, 0, 0};
-        return {0.5, 0.5, 0.5};
+        //vertex.emitted = bg_color;
+//        vertex.emitted = {0, 0, 0};
+        vertex.emitted = {0.5, 0.5, 0.5};
+        return vertex;
     }
 
     Vector3 d = ray.get_direction();
@@ -264,7 +387,8 @@ Vector3 Pathtracer::trace(Ray &ray, const int depth = 0) {
     Vector3 emission = material->emission;
     if (emission.x > 0 || emission.y > 0 || emission.z > 0) {
         ray.nne_has_hit_light = true;
-        return emission;
+        vertex.emitted = emission;
+        return vertex;
     }
 
     Vector3 hit_point = ray.get_hit_point();
@@ -272,45 +396,50 @@ Vector3 Pathtracer::trace(Ray &ray, const int depth = 0) {
     if(material->shader_id == ShaderID::Mirror){
         Vector3 omega_i = v.Reflect(normal);
         omega_i.Normalize();
-        Ray secondary_ray = make_secondary_ray(ray.get_hit_point(), omega_i, IOR_AIR);
-        Vector3 L_i = trace(secondary_ray, depth + 1);
-        return material->reflectivity * L_i;
+        vertex = PathVertex(make_secondary_ray(ray.get_hit_point(), omega_i, IOR_AIR));
+        vertex.weight = Vector3(material->reflectivity, material->reflectivity, material->reflectivity);
+        return vertex;
     }
 
     if(material->shader_id == ShaderID::Phong){
         return get_phong_simple(normal, v, hit_point,material->diffuse,
-                                material->specular, material->shininess, depth);
+                                material->specular, material->shininess);
     }
 
     if(material->shader_id == ShaderID::PhongConserving){
         return get_phong_LW(normal, v, hit_point, material->diffuse,
-                              material->specular, material->shininess, depth);
+                              material->specular, material->shininess);
     }
 
     if(material->shader_id == ShaderID::PhongNormalized){
         return get_phong_arvo(normal, v, hit_point, material->diffuse,
-                              material->specular, material->shininess, depth);
+                              material->specular, material->shininess);
     }
 
     // LAMBERT
-    return get_color_lambert(material->diffuse, normal, ray.get_hit_point(), depth);
+    return get_color_lambert(material->diffuse, normal, ray.get_hit_point());
 }
 
-Vector3 Pathtracer::add_color_nne(Vector3 L_indirect, Vector3 f_r, Vector3 normal,Vector3 hit_point,
-                                  bool has_hit_light, float russian_roulette){
-
-    Vector3 L_direct = get_direct_light_color(hit_point, normal, f_r);
+void Pathtracer::add_color_nne(PathVertex &vertex, Vector3 f_r, Vector3 normal, Vector3 hit_point,
+                               float russian_roulette){
+    // counted by resolve_light_sample once the shadow ray is answered
+    Vector3 L_direct = get_direct_light_color(hit_point, normal, f_r, vertex.light_ray);
+    vertex.light_color = L_direct / russian_roulette;
+    vertex.has_light_sample = true;
+}
 
-    if(has_hit_light && (L_direct > Vector3(0, 0, 0))){
-        return L_direct / russian_roulette;
+void Pathtracer::resolve_light_sample(PathVertex &vertex, const bool occluded){
+    if(occluded){
+        return;
     }
+    vertex.emitted += vertex.light_color;
 
-    Vector3 L_r = (L_direct + L_indirect) / russian_roulette;
-    return L_r;
+    // the light hit by the next ray is already in the sample
+    vertex.skip_light = vertex.light_color > Vector3(0, 0, 0);
 }
 
-Vector3 Pathtracer::get_phong_arvo(Vector3 normal, Vector3 omega_o, Vector3 hit_point,
-                                   Vector3 diffuse_color, Vector3 specular_color, float shininess, int depth){
+PathVertex Pathtracer::get_phong_arvo(Vector3 normal, Vector3 omega_o, Vector3 hit_point,
+                                      Vector3 diffuse_color, Vector3 specular_color, float shininess){
     // energy normalized phong
     omega_o.Normalize();
     normal.Normalize();
@@ -323,7 +452,7 @@ Vector3 Pathtracer::get_phong_arvo(Vector3 normal, Vector3 omega_o, Vector3 hit_
     // russian roulette
     float alpha = max(diffuse_max, specular_max);
     if(alpha <= Random(0, 1)){
-        return {0, 0, 0};
+        return {};
     }
 
     float random_v = Random(0, diffuse_max + specular_max);
@@ -331,18 +460,17 @@ Vector3 Pathtracer::get_phong_arvo(Vector3 normal, Vector3 omega_o, Vector3 hit_
         float pdf;
         Vector3 omega_i = sample_cosine_hemisphere(normal, pdf);
 
-        Ray secondary_ray = make_secondary_ray(hit_point, omega_i, IOR_AIR);
-        Vector3 L_i = trace(secondary_ray, depth + 1);
+        PathVertex vertex(make_secondary_ray(hit_point, omega_i, IOR_AIR));
         pdf*= diffuse_max / (diffuse_max + specular_max);
 
         float cos_theta = omega_i.DotProduct(normal);
         Vector3 f_r = diffuse_color / M_PI;
 
-        Vector3 L_r = L_i * f_r * (cos_theta) / (pdf);
+        vertex.weight = f_r * (cos_theta) / (pdf * alpha);
         if(TriangleLight::NNE) {
-            return add_color_nne(L_r, f_r, normal, hit_point, secondary_ray.nne_has_hit_light, alpha);
+            add_color_nne(vertex, f_r, normal, hit_point, alpha);
         }
-        return L_r / alpha;
+        return vertex;
     }
 
     float pdf;
@@ -351,11 +479,10 @@ Vector3 Pathtracer::get_phong_arvo(Vector3 normal, Vector3 omega_o, Vector3 hit_
 
 
     if (omega_i.DotProduct(normal) <= 0.0f){
-        return {0, 0, 0};
+        return {};
     }
 
-    Ray secondary_ray = make_secondary_ray(hit_point, omega_i, IOR_AIR);
-    Vector3 L_i = trace(secondary_ray, depth + 1);
+    PathVertex vertex(make_secondary_ray(hit_point, omega_i, IOR_AIR));
 
     float cos_theta = clamp(omega_i.DotProduct(normal));
     float cos_theta_r = clamp(omega_i.DotProduct(omega_r));
@@ -366,12 +493,12 @@ Vector3 Pathtracer::get_phong_arvo(Vector3 normal, Vector3 omega_o, Vector3 hit_
     float I_m = get_Mallett_Yuksel_IM(cos_theta_o, shininess);
     Vector3 f_r = specular_color * (1 / I_m) * powf(cos_theta_r, shininess);
 
-    Vector3 L_r = L_i * f_r * (cos_theta) / (pdf * alpha);
-    return L_r;
+    vertex.weight = f_r * (cos_theta) / (pdf * alpha);
+    return vertex;
 }
 
-Vector3 Pathtracer::get_phong_LW(Vector3 normal, Vector3 omega_o, Vector3 hit_point,
-                                  Vector3 diffuse_color, Vector3 specular_color, float shininess, int depth){
+PathVertex Pathtracer::get_phong_LW(Vector3 normal, Vector3 omega_o, Vector3 hit_point,
+                                    Vector3 diffuse_color, Vector3 specular_color, float shininess){
 
     float diffuse_max = diffuse_color.LargestComponentValue();
     float specular_max = specular_color.LargestComponentValue();
@@ -379,7 +506,7 @@ Vector3 Pathtracer::get_phong_LW(Vector3 normal, Vector3 omega_o, Vector3 hit_po
     // russian roulette
     float alpha = max(diffuse_max, specular_max);
     if(alpha <= Random(0, 1)){
-        return {0, 0, 0};
+        return {};
     }
 
     float random_v = Random(0, diffuse_max + specular_max);
@@ -387,19 +514,18 @@ Vector3 Pathtracer::get_phong_LW(Vector3 normal, Vector3 omega_o, Vector3 hit_po
         float pdf;
         Vector3 omega_i = sample_cosine_hemisphere(normal, pdf);
 
-        Ray secondary_ray = make_secondary_ray(hit_point, omega_i, IOR_AIR);
-        Vector3 L_i = trace(secondary_ray, depth + 1);
+        PathVertex vertex(make_secondary_ray(hit_point, omega_i, IOR_AIR));
         pdf*= diffuse_max / (diffuse_max + specular_max);
 
         Vector3 f_r = diffuse_color / M_PI;
         float cos_theta = omega_i.DotProduct(normal);
         float cos_theta_o = omega_o.DotProduct(normal);
 
-        Vector3 L_r = L_i * f_r * (cos_theta) / (pdf);
+        vertex.weight = f_r * (cos_theta) / (pdf * alpha);
         if(TriangleLight::NNE) {
-            return add_color_nne(L_r, f_r, normal, hit_point, secondary_ray.nne_has_hit_light, alpha);
+            add_color_nne(vertex, f_r, normal, hit_point, alpha);
         }
-        return L_r / alpha;
+        return vertex;
     }
 
      float pdf;
@@ -408,11 +534,10 @@ Vector3 Pathtracer::get_phong_LW(Vector3 normal, Vector3 omega_o, Vector3 hit_po
 
 
      if (omega_i.DotProduct(normal) <= 0.0f){
-         return {0, 0, 0};
+         return {};
      }
 
-     Ray secondary_ray = make_secondary_ray(hit_point, omega_i, IOR_AIR);
-     Vector3 L_i = trace(secondary_ray, depth + 1);
+     PathVertex vertex(make_secondary_ray(hit_point, omega_i, IOR_AIR));
 
     float cos_theta = omega_i.DotProduct(normal);
     float cos_theta_o = omega_o.DotProduct(normal);
@@ -427,18 +552,17 @@ Vector3 Pathtracer::get_phong_LW(Vector3 normal, Vector3 omega_o, Vector3 hit_po
         f_r = f_r / cos_theta;
     }
 
-     Vector3 L_r = L_i * f_r * (cos_theta) / (pdf * alpha);
-     return L_r;
+     vertex.weight = f_r * (cos_theta) / (pdf * alpha);
+     return vertex;
 }
 
 
-Vector3 Pathtracer::get_phong_simple(Normal3f normal, Vector3 omega_o, Vector3 hit_point,
-                                           Vector3 diffuse_color, Vector3 specular_color,
-                                           float shininess, int depth) {
+PathVertex Pathtracer::get_phong_simple(Normal3f normal, Vector3 omega_o, Vector3 hit_point,
+                                        Vector3 diffuse_color, Vector3 specular_color,
+                                        float shininess) {
     float pdf;
     Vector3 omega_i = sample_cosine_hemisphere(normal, pdf);
-    Ray secondary_ray = make_secondary_ray(hit_point, omega_i, IOR_AIR);
-    Vector3 L_i = trace(secondary_ray, depth + 1);
+    PathVertex vertex(make_secondary_ray(hit_point, omega_i, IOR_AIR));
 
     float cos_theta = omega_i.DotProduct(normal);
 
@@ -447,30 +571,29 @@ Vector3 Pathtracer::get_phong_simple(Normal3f normal, Vector3 omega_o, Vector3 h
 
     Vector3 f_r = diffuse_color / M_PI
                   + specular_color * (shininess + 2) / (2 * M_PI) * powf(cos_theta_r, shininess);
-    Vector3 L_r = L_i * f_r * (cos_theta) / ( pdf );
-    return L_r;
+    vertex.weight = f_r * (cos_theta) / ( pdf );
+    return vertex;
 }
 
-Vector3 Pathtracer::get_color_lambert(Vector3 diffuse_color, Normal3f normal, Vector3 hit_point, int depth){
+PathVertex Pathtracer::get_color_lambert(Vector3 diffuse_color, Normal3f normal, Vector3 hit_point){
     // russian roulette
     float alpha = diffuse_color.LargestComponentValue();
     if(alpha <= Random(0, 1)){
-        return {0, 0, 0};
+        return {};
     }
 
     float pdf;
     Vector3 omega_i = sample_cosine_hemisphere(normal, pdf);
-    Ray secondary_ray = make_secondary_ray(hit_point, omega_i, IOR_AIR);
-    Vector3 L_i = trace(secondary_ray, depth + 1);
+    PathVertex vertex(make_secondary_ray(hit_point, omega_i, IOR_AIR));
 
     float cos_theta = omega_i.DotProduct(normal);
     Vector3 f_r = diffuse_color / M_PI;
-    Vector3 L_r = L_i * f_r * (cos_theta) / ( pdf );
+    vertex.weight = f_r * (cos_theta) / (pdf * alpha);
 
     if(TriangleLight::NNE){
-        return add_color_nne(L_r, f_r, normal, hit_point, secondary_ray.nne_has_hit_light, alpha);
+        add_color_nne(vertex, f_r, normal, hit_point, alpha);
     }
-    return L_r / alpha;
+    return vertex;
 }
 
 Vector3 Pathtracer::sample_hemisphere(Normal3f normal, float &pdf) {
@@ -614,7 +737,8 @@ void Pathtracer::fresnel_reflectance(Vector3 diffuse, Vector3 specular, float co
     Rd = ((1 - F.LargestComponentValue()) / bottom) * diffuse;
 }
 
-Vector3 Pathtracer::get_direct_light_color(Vector3 hit_point, Vector3 hit_normal, Vector3 diffuse_color){
+Vector3 Pathtracer::get_direct_light_color(Vector3 hit_point, Vector3 hit_normal, Vector3 diffuse_color,
+                                           ShadowRay &shadow_ray){
     // get random light
     float random_cdf = Random(0, 1);
     std::shared_ptr<TriangleLight> light = TriangleLight::get_light(random_cdf, lights_);
@@ -625,10 +749,8 @@ Vector3 Pathtracer::get_direct_light_color(Vector3 hit_point, Vector3 hit_normal
     Vector3 light_point = light->get_random_point(area, light_normal);
     light_normal.Normalize();
 
-    // check if light is visible
-    if(!is_visible(hit_point, light_point)){
-        return {0, 0, 0};
-    }
+    // the caller finds out if light is visible
+    shadow_ray = make_shadow_ray(hit_point, light_point);
 
     // get direction to light
     Vector3 omega_i = light_point - hit_point;
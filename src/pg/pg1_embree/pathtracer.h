@@ -4,9 +4,28 @@
 #include "camera.h"
 #include "ray.h"
 #include "SphereMap.h"
-#include "BVH.h"
+#include "Accelerator.h"
 #include "TriangleLight.h"
 
+// one bounce of a path, what its hit adds and where the path goes next
+struct PathVertex{
+    Vector3 emitted{0, 0, 0};       // radiance of this vertex, weighted by the throughput up to it
+    Vector3 weight{0, 0, 0};        // throughput factor of the next ray
+    bool has_next = false;          // false ends the path
+    Ray next;
+
+    // next event estimation, counted only if its shadow ray is not occluded
+    bool has_light_sample = false;
+    ShadowRay light_ray;
+    Vector3 light_color{0, 0, 0};
+    bool skip_light = false;        // the emission of a light hit by the next ray is already in the sample
+
+    PathVertex() = default;
+
+    explicit PathVertex(const Ray &next) : has_next(true), next(next){
+    }
+};
+
 class Pathtracer : public SimpleGuiDX11
 {
 public:
@@ -21,8 +40,13 @@ public:
 
 	void LoadScene( const std::string file_name );
 
+    // rebuilds the backend right away when a scene is already loaded
+    void SetAccelerator( AcceleratorType type );
+
 	Color4f get_pixel( int x, int y, float t = 0.0f ) override;
 
+	void get_tile( int x0, int y0, int w, int h, float t, float * pixels ) override;
+
 	int Ui() override;
 
     void LoadBackground();
@@ -30,7 +54,9 @@ private:
 	std::vector<Surface *> surfaces_;
 	std::vector<Material *> materials_;
     std::unique_ptr<SphereMap> background_;
-    std::unique_ptr<BVH> bvh_;
+    AcceleratorScene accelerator_scene_;
+    std::unique_ptr<Accelerator> accelerator_;
+    AcceleratorType accelerator_type_ = AcceleratorType::Embree;
     std::vector<std::shared_ptr<TriangleLight>> lights_;
 
     float * buffer_data;
@@ -40,11 +66,23 @@ private:
 	RTCScene scene_;
 	Camera camera_;
 
-    bool is_visible(Vector3 hit_point, Vector3 light_point);
+    ShadowRay make_shadow_ray(Vector3 hit_point, Vector3 light_point);
 
     Ray make_secondary_ray(const Vector3 &origin, const Vector3 &dir, float ior);
 
-    Vector3 trace(Ray &ray, int depth);
+    // camera samples of one pixel, appended to rays
+    void generate_pixel_rays(int x, int y, std::vector<Ray> &rays);
+
+    // adds the samples to the progressive buffers and returns the pixel average
+    Color4f accumulate_pixel(int x, int y, Vector3 acc, int total_samples);
+
+    // radiance of every camera ray, the paths advance bounce by bounce and each bounce is one accelerator batch
+    std::vector<Vector3> trace_paths(std::vector<Ray> &rays);
+
+    // shading of an already intersected ray
+    PathVertex scatter(Ray &ray);
+
+    void resolve_light_sample(PathVertex &vertex, bool occluded);
 
     static Vector3 sample_hemisphere(Normal3f normal, float &pdf);
 
@@ -54,23 +92,23 @@ private:
 
     static float get_Mallett_Yuksel_IM(float NdotV, float n);
 
-    Vector3 get_color_lambert(Vector3 diffuse_color, Normal3f normal, Vector3 hit_point, int depth);
+    PathVertex get_color_lambert(Vector3 diffuse_color, Normal3f normal, Vector3 hit_point);
 
-    Vector3 get_phong_simple(Normal3f normal, Vector3 omega_o, Vector3 hit_point, Vector3 diffuse_color,
-                             Vector3 specular_color, float shininess, int depth);
+    PathVertex get_phong_simple(Normal3f normal, Vector3 omega_o, Vector3 hit_point, Vector3 diffuse_color,
+                                Vector3 specular_color, float shininess);
 
-    Vector3 get_phong_LW(Vector3 normal, Vector3 omega_o, Vector3 hit_point, Vector3 diffuse_color,
-                         Vector3 specular_color, float shininess, int depth);
+    PathVertex get_phong_LW(Vector3 normal, Vector3 omega_o, Vector3 hit_point, Vector3 diffuse_color,
+                            Vector3 specular_color, float shininess);
 
-    Vector3 get_phong_arvo(Vector3 normal, Vector3 omega_o, Vector3 hit_point, Vector3 diffuse_color,
-                           Vector3 specular_color, float shininess, int depth);
+    PathVertex get_phong_arvo(Vector3 normal, Vector3 omega_o, Vector3 hit_point, Vector3 diffuse_color,
+                              Vector3 specular_color, float shininess);
 
     Vector3 sample_cosine_lobe(Vector3 omega_r, float gamma, float &pdf);
 
     static void fresnel_reflectance(Vector3 diffuse, Vector3 specular, float cos_theta, Vector3 &F, Vector3 &Rd);
 
-    Vector3 get_direct_light_color(Vector3 hit_point, Vector3 normal, Vector3 diffuse_color);
+    // unoccluded light sample, shadow_ray receives its visibility query
+    Vector3 get_direct_light_color(Vector3 hit_point, Vector3 normal, Vector3 diffuse_color, ShadowRay &shadow_ray);
 
-    Vector3 add_color_nne(Vector3 L_indirect, Vector3 f_r, Vector3 normal, Vector3 hit_point,
-                          bool has_hit_light, float russian_roulette);
+    void add_color_nne(PathVertex &vertex, Vector3 f_r, Vector3 normal, Vector3 hit_point, float russian_roulette);
 };
@@ -3,52 +3,28 @@
 //
 
 #include "ray.h"
-#include "embree3/rtcore_scene.h"
 
-bool Ray::BVH_BOOL = false;
-
-void Ray::intersect(RTCScene _scene) {
-    this->scene = std::make_shared<RTCScene>(_scene);
-    RTCIntersectContext context{};
-    rtcInitIntersectContext(&context);
-
-    if(BVH_BOOL){
-    }
-    else{
-        rtcIntersect1(_scene, &context, &ray_hit);
-    }
+void Ray::set_hit(float tfar_, unsigned int geom_id, unsigned int prim_id, float u, float v,
+                  const Normal3f &normal_, const Coord2f &tex_coord_, Material *material_) {
+    ray_hit.ray.tfar = tfar_;
+    ray_hit.hit.geomID = geom_id;
+    ray_hit.hit.primID = prim_id;
+    ray_hit.hit.u = u;
+    ray_hit.hit.v = v;
+    normal = normal_;
+    tex_coord = tex_coord_;
+    material = material_;
 }
 
 Material * Ray::get_material() const {
-    if(BVH_BOOL){
-        return bvh_hit_point->material;
-    }
-
-    RTCGeometry geometry = rtcGetGeometry(*scene, ray_hit.hit.geomID);
-    return (Material*) rtcGetGeometryUserData(geometry);
+    return material;
 }
 
 Normal3f Ray::get_normal() const {
-    if(BVH_BOOL){
-        return bvh_hit_point->normal;
-    }
-
-    Normal3f normal{};
-    RTCGeometry geometry = rtcGetGeometry(*scene, ray_hit.hit.geomID);
-    rtcInterpolate0(geometry, ray_hit.hit.primID, ray_hit.hit.u, ray_hit.hit.v,
-                    RTC_BUFFER_TYPE_VERTEX_ATTRIBUTE, 0, &normal.x, 3);
     return normal;
 }
 
 Coord2f Ray::get_texture_coord() const {
-    Coord2f tex_coord{};
-    if(BVH_BOOL){
-        return bvh_hit_point->text_coords;
-    }
-
-    RTCGeometry geometry = rtcGetGeometry(*scene, ray_hit.hit.geomID);
-    rtcInterpolate0(geometry, ray_hit.hit.primID, ray_hit.hit.u, ray_hit.hit.v,
-                    RTC_BUFFER_TYPE_VERTEX_ATTRIBUTE, 1, &tex_coord.u, 2);
     return tex_coord;
 }
 
@@ -76,15 +52,9 @@ float Ray::get_ior() const {
 
 void Ray::set_tfar(float tfar_) {
     ray_hit.ray.tfar = tfar_;
-    if(BVH_BOOL){
-        bvh_hit_point->tfar = tfar_;
-    }
 }
 
 float Ray::get_tfar() const {
-    if(BVH_BOOL){
-        return bvh_hit_point->tfar;
-    }
     return ray_hit.ray.tfar;
 }
 
@@ -93,9 +63,6 @@ float Ray::get_tnear() const {
 }
 
 bool Ray::has_hit() const {
-    if(BVH_BOOL){
-        return bvh_hit_point->is_intersected;
-    }
     return ray_hit.hit.geomID != RTC_INVALID_GEOMETRY_ID;
 }
 
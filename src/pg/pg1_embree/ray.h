@@ -10,18 +10,16 @@
 #include <memory>
 #include "embree3/rtcore_ray.h"
 #include "material.h"
-#include "BVH.h"
-
-class BVHHitPoint;
 
 class Ray {
 
 public:
-    static bool BVH_BOOL;
-
     RTCRayHit ray_hit;
-    std::shared_ptr<RTCScene> scene;
-    std::shared_ptr<BVHHitPoint> bvh_hit_point;
+
+    // attributes of the closest hit, resolved by the accelerator that found it
+    Normal3f normal;
+    Coord2f tex_coord{};
+    Material *material = nullptr;
 
     bool nne_has_hit_light = false;
 
@@ -73,12 +71,11 @@ public:
         ray_hit.hit.v = 0.0f;
         ray_hit.hit.primID = RTC_INVALID_GEOMETRY_ID;
         ray_hit.hit.geomID = RTC_INVALID_GEOMETRY_ID;
-        if(BVH_BOOL){
-            bvh_hit_point = std::make_shared<BVHHitPoint>();
-        }
     }
 
-    void intersect(RTCScene _scene);
+    // stores a closest hit, every accelerator goes through it so the getters do not depend on the backend
+    void set_hit(float tfar_, unsigned int geom_id, unsigned int prim_id, float u, float v,
+                 const Normal3f &normal_, const Coord2f &tex_coord_, Material *material_);
 
     Normal3f get_normal() const;
 
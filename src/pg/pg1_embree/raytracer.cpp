@@ -48,11 +48,15 @@ void Raytracer::LoadScene(const std::string file_name)
 {
 	const int no_surfaces = LoadOBJ(file_name.c_str(), surfaces_, materials_);
 
-    std::vector<std::shared_ptr<BVHTriangle>> bvh_triangles;
+    std::vector<std::shared_ptr<BVHTriangle>> &bvh_triangles = accelerator_scene_.triangles;
+    bvh_triangles.clear();
+    accelerator_scene_.surface_offsets.clear();
 
 	// surfaces loop
 	for (auto surface : surfaces_)
 	{
+        accelerator_scene_.surface_offsets.push_back((int) bvh_triangles.size());
+
 		RTCGeometry mesh = rtcNewGeometry(device_, RTC_GEOMETRY_TYPE_TRIANGLE);
 
 		Vertex3f* vertices = (Vertex3f*)rtcSetNewGeometryBuffer(
@@ -116,10 +120,26 @@ void Raytracer::LoadScene(const std::string file_name)
 		rtcReleaseGeometry(mesh);
 	} // end of surfaces loop
 
-    bvh_ = std::make_unique<BVH>(bvh_triangles);
-    bvh_->BuildTree();
-
 	rtcCommitScene(scene_);
+
+    accelerator_scene_.scene = scene_;
+
+    // every 4th pixel of the camera, BVHAutoTune times its candidate trees on them
+    accelerator_scene_.camera_rays.clear();
+    for (int y = 0; y < height(); y += 4) {
+        for (int x = 0; x < width(); x += 4) {
+            accelerator_scene_.camera_rays.push_back(camera_.GenerateRay(x + 0.5f, y + 0.5f));
+        }
+    }
+    accelerator_ = Accelerator::Create(accelerator_type_, accelerator_scene_);
+}
+
+void Raytracer::SetAccelerator(const AcceleratorType type)
+{
+    accelerator_type_ = type;
+    if(accelerator_){
+        accelerator_ = Accelerator::Create(accelerator_type_, accelerator_scene_);
+    }
 }
 
 int Raytracer::Ui()
@@ -133,6 +153,13 @@ int Raytracer::Ui()
     ImGui::Text("Materials = %d", materials_.size());
     ImGui::Separator();
     ImGui::Checkbox("Vsync", &vsync_);
+    ImGui::Checkbox("BVH stats", &BVH::COLLECT_STATS);
+    if(accelerator_){
+        ImGui::Text("Accelerator = %s", accelerator_->Name());
+    }
+    if(BVH::COLLECT_STATS && accelerator_ && accelerator_->AverageVisitedNodes() >= 0){
+        ImGui::Text("%s nodes/ray = %.1f", accelerator_->Name(), accelerator_->AverageVisitedNodes());
+    }
 
     ImGui::SliderFloat("float", &f, 0.0f, 1.0f); // Edit 1 float using a slider from 0.0f to 1.0f
     //ImGui::ColorEdit3( "clear color", ( float* )&clear_color ); // Edit 3 floats representing a color
@@ -163,21 +190,23 @@ int Raytracer::Ui()
 }
 
 bool Raytracer::is_visible(const Vector3 hit_point, const Vector3 light_point){
+    const ShadowRay shadow_ray = make_shadow_ray(hit_point, light_point);
+    return !accelerator_->Occluded(shadow_ray.origin, shadow_ray.direction, shadow_ray.tmax, shadow_ray.tnear);
+}
+
+ShadowRay Raytracer::make_shadow_ray(const Vector3 &hit_point, const Vector3 &light_point){
 
     // vector to light
-    Vector3 l = light_point - hit_point;
-    float dist = l.L2Norm();
+    ShadowRay shadow_ray;
+    shadow_ray.origin = hit_point;
+    shadow_ray.direction = light_point - hit_point;
+    shadow_ray.tmax = shadow_ray.direction.L2Norm();
 
-    l *= 1.0f / dist;
+    shadow_ray.direction *= 1.0f / shadow_ray.tmax;
 
     // to avoid self-shadowing
-    Ray ray(hit_point, l, 0.001f);
-    ray.set_tfar(dist);
-    ray.intersect(scene_);
-    if(Ray::BVH_BOOL){
-        bvh_->Traverse(ray);
-    }
-    return !ray.has_hit();
+    shadow_ray.tnear = 0.001f;
+    return shadow_ray;
 }
 
 void Raytracer::LoadBackground() {
@@ -188,10 +217,9 @@ Ray Raytracer::make_secondary_ray(const Vector3& origin, const Vector3& dir, con
     return Ray{origin, dir, 0.001f, ior};
 }
 
-Color4f Raytracer::get_pixel(const int x, const int y, const float t)
+void Raytracer::generate_pixel_rays(const int x, const int y, std::vector<Ray> &rays)
 {
     int sample_count = 8;
-    Vector3 acc = {0, 0, 0};
 
     // Super sampling
     for (int i = 0; i < sample_count; i++) {
@@ -200,23 +228,29 @@ Color4f Raytracer::get_pixel(const int x, const int y, const float t)
             float y_in = y + j * (1.0 / sample_count) + Random(0, 1) / sample_count;
 
         // No Depth of field
-//            Ray ray(this->camera_.GenerateRay(x_in, y_in));
-//            auto rays = std::vector<Ray>{ray};
+//            rays.push_back(this->camera_.GenerateRay(x_in, y_in));
 
         // Depth of field
-            auto rays = this->camera_.GenerateRaysDoF(x_in, y_in, 189,
-                                                      1, 1.5);
-
-            Vector3 acc_d = {0, 0, 0};
-            for(auto& ray : rays){
-                Vector3 result = trace(ray, 0);
-                acc_d += result;
-            }
-            acc_d /= rays.size();
-            acc += acc_d;
+            auto dof_rays = this->camera_.GenerateRaysDoF(x_in, y_in, 189,
+                                                          1, 1.5);
+            rays.insert(rays.end(), dof_rays.begin(), dof_rays.end());
         }
     }
-    acc /= (sample_count * sample_count);
+}
+
+Color4f Raytracer::get_pixel(const int x, const int y, const float t)
+{
+    Vector3 acc = {0, 0, 0};
+
+    // the samples of one pixel are coherent, the accelerator gets them as one batch
+    std::vector<Ray> pixel_rays;
+    generate_pixel_rays(x, y, pixel_rays);
+
+    // every sample casts the same number of rays, so one average over all of them is the same
+    for(auto& result : trace_batch(pixel_rays, 0)){
+        acc += result;
+    }
+    acc /= pixel_rays.size();
     return static_cast<Color4f>(acc);
 
 //    // No super sampling
@@ -225,18 +259,104 @@ Color4f Raytracer::get_pixel(const int x, const int y, const float t)
 //    return static_cast<Color4f>(result);
 }
 
+void Raytracer::get_tile(const int x0, const int y0, const int w, const int h, const float t, float *pixels)
+{
+    // the camera rays of the whole tile form one batch, pixel after pixel, so the accelerator can bound them
+    std::vector<Ray> tile_rays;
+    std::vector<size_t> pixel_starts;
+    for (int y = y0; y < y0 + h; y++) {
+        for (int x = x0; x < x0 + w; x++) {
+            pixel_starts.push_back(tile_rays.size());
+            generate_pixel_rays(x, y, tile_rays);
+        }
+    }
+    pixel_starts.push_back(tile_rays.size());
+
+    const std::vector<Vector3> results = trace_batch(tile_rays, 0);
+    for (size_t pixel = 0; pixel + 1 < pixel_starts.size(); pixel++) {
+        Vector3 acc = {0, 0, 0};
+        for (size_t i = pixel_starts[pixel]; i < pixel_starts[pixel + 1]; i++) {
+            acc += results[i];
+        }
+        acc /= pixel_starts[pixel + 1] - pixel_starts[pixel];
+
+        const Color4f color = static_cast<Color4f>(acc);
+        pixels[pixel * 4] = color.r;
+        pixels[pixel * 4 + 1] = color.g;
+        pixels[pixel * 4 + 2] = color.b;
+        pixels[pixel * 4 + 3] = color.a;
+    }
+}
+
 
 Vector3 Raytracer::trace(Ray ray, const int depth = 0) {
     if(depth >= 10){
         return {0, 0, 0};
     }
 
-    ray.intersect(scene_);
+    accelerator_->Intersect(ray);
+
+    // glass does not look at the light, so it casts no shadow ray
+    const bool visible = ray.has_hit()
+            && static_cast<ShaderID>(ray.get_material()->shader_id) != ShaderID::Glass
+            && is_visible(ray.get_hit_point(), omni_light_position_);
+    return shade(ray, depth, visible);
+}
+
+std::vector<Vector3> Raytracer::trace_batch(std::vector<Ray> &rays, const int depth) {
+    std::vector<Vector3> colors(rays.size(), Vector3(0, 0, 0));
+    if(depth >= 10){
+        return colors;
+    }
 
-    if(Ray::BVH_BOOL){
-        bvh_->Traverse(ray);
+    // camera rays are bounded by beams, the reflections go in packets
+    if(depth == 0){
+        accelerator_->IntersectTile(rays.data(), (int) rays.size());
+    }
+    else{
+        accelerator_->IntersectBatch(rays.data(), (int) rays.size());
     }
 
+    // the shadow rays of the whole batch go to the accelerator together, glass does not look at the light
+    std::vector<ShadowRay> shadow_rays;
+    std::vector<int> shadow_ray_of(rays.size(), -1);
+    for(size_t i = 0; i < rays.size(); i++){
+        if(rays[i].has_hit() && static_cast<ShaderID>(rays[i].get_material()->shader_id) != ShaderID::Glass){
+            shadow_ray_of[i] = (int) shadow_rays.size();
+            shadow_rays.push_back(make_shadow_ray(rays[i].get_hit_point(), omni_light_position_));
+        }
+    }
+    accelerator_->OccludedBatch(shadow_rays.data(), (int) shadow_rays.size());
+
+    // mirror reflections stay coherent, they form the next batch instead of recursing ray by ray
+    std::vector<Ray> reflected;
+    std::vector<size_t> reflected_from;
+    for(size_t i = 0; i < rays.size(); i++){
+        Ray &ray = rays[i];
+        const bool visible = shadow_ray_of[i] >= 0 && !shadow_rays[shadow_ray_of[i]].occluded;
+        if(visible && static_cast<ShaderID>(ray.get_material()->shader_id) == ShaderID::Mirror){
+            Normal3f normal = ray.get_normal();
+            const Vector3 d = ray.get_direction();
+            if(normal.DotProduct(d) > 0.0f){
+                normal = normal*(-1.0f);
+            }
+            reflected.push_back(make_mirror_ray(ray, normal, -d));
+            reflected_from.push_back(i);
+            continue;
+        }
+        colors[i] = shade(ray, depth, visible);
+    }
+
+    if(!reflected.empty()){
+        std::vector<Vector3> reflected_colors = trace_batch(reflected, depth + 1);
+        for(size_t i = 0; i < reflected.size(); i++){
+            colors[reflected_from[i]] = reflected_colors[i];
+        }
+    }
+    return colors;
+}
+
+Vector3 Raytracer::shade(Ray &ray, const int depth, const bool visible) {
     if (ray.has_hit())
     {
 
@@ -261,14 +381,14 @@ Vector3 Raytracer::trace(Ray ray, const int depth = 0) {
         auto shaderId = static_cast<ShaderID>(material->shader_id);
 
         if(shaderId == ShaderID::Phong){
-            return get_color_phong(ray, hit_point, omni_light_position_, normal, v, l, depth, material);
+            return get_color_phong(ray, hit_point, omni_light_position_, normal, v, l, depth, material, visible);
         }
 
         if(shaderId == ShaderID::Glass){
             return get_color_glass(ray, normal, v, l, depth, material);
         }
 
-        if(is_visible(hit_point, omni_light_position_)){
+        if(visible){
             if(shaderId == ShaderID::Normal){
                 return {normal.x, normal.y, normal.z};
             }
@@ -320,7 +440,7 @@ Vector3 Raytracer::get_color_lambert(Ray& ray, Vector3 normal, Vector3 l, Materi
 
 Vector3 Raytracer::get_color_phong(Ray& ray, Vector3 hit_point, Vector3 omni_light_position,
                                    Vector3 normal, Vector3 v, Vector3 l,
-                                   int depth, Material* material) {
+                                   int depth, Material* material, bool visible) {
 
     Vector3 diffuse_color_v = ray.get_diffuse_color();
     Vector3 specular_color_v = ray.get_specular_color();
@@ -331,7 +451,7 @@ Vector3 Raytracer::get_color_phong(Ray& ray, Vector3 hit_point, Vector3 omni_lig
 
     Vector3 c_phong = material->ambient;
     
-    if(is_visible(hit_point, omni_light_position)){
+    if(visible){
         Vector3 l_r = l.Reflect(normal);
         l_r.Normalize();
         float diff = fabsf(normal.DotProduct(l));
@@ -400,6 +520,14 @@ Vector3 Raytracer::get_color_glass(Ray &ray, Vector3 normal, Vector3 v, Vector3
 Vector3 Raytracer::get_color_mirror(Ray &ray, Vector3 normal, Vector3 v, Vector3 l,
                                     int depth, Material* material){
 
+    Ray secondary_refl = make_mirror_ray(ray, normal, v);
+    Vector3 c_refl = trace(secondary_refl, depth + 1);
+
+    return c_refl;
+}
+
+Ray Raytracer::make_mirror_ray(Ray &ray, Vector3 normal, Vector3 v){
+
     Vector3 hit_point = ray.get_hit_point();
 
     float n1 = ray.get_ior();
@@ -407,8 +535,5 @@ Vector3 Raytracer::get_color_mirror(Ray &ray, Vector3 normal, Vector3 v, Vector3
     normal.Normalize();
 
     Vector3 v_r = v.Reflect(normal);
-    Ray secondary_refl = make_secondary_ray(hit_point, v_r, n1);
-    Vector3 c_refl = trace(secondary_refl, depth + 1);
-
-    return c_refl;
+    return make_secondary_ray(hit_point, v_r, n1);
 }
\ No newline at end of file
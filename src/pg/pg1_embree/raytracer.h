@@ -4,7 +4,7 @@
 #include "camera.h"
 #include "ray.h"
 #include "SphereMap.h"
-#include "BVH.h"
+#include "Accelerator.h"
 
 /*! \class Raytracer
 \brief General ray tracer class.
@@ -27,7 +27,11 @@ public:
 
 	void LoadScene( const std::string file_name );
 
+    // rebuilds the backend right away when a scene is already loaded
+    void SetAccelerator( AcceleratorType type );
+
 	Color4f get_pixel( int x, int y, float t = 0.0f ) override;
+	void get_tile( int x0, int y0, int w, int h, float t, float * pixels ) override;
 
 	int Ui() override;
 
@@ -36,7 +40,9 @@ private:
 	std::vector<Surface *> surfaces_;
 	std::vector<Material *> materials_;
     std::unique_ptr<SphereMap> background_;
-    std::unique_ptr<BVH> bvh_;
+    AcceleratorScene accelerator_scene_;
+    std::unique_ptr<Accelerator> accelerator_;
+    AcceleratorType accelerator_type_ = AcceleratorType::Embree;
 
 	RTCDevice device_;
 	RTCScene scene_;
@@ -45,18 +51,29 @@ private:
     Vector3 omni_light_position_ = Vector3(100, 0, 130);
 
     bool is_visible(Vector3 hit_point, Vector3 light_point);
+    ShadowRay make_shadow_ray(const Vector3 &hit_point, const Vector3 &light_point);
 
     Ray make_secondary_ray(const Vector3 &origin, const Vector3 &dir, float ior);
 
     Vector3 trace(Ray ray, int depth);
+    // camera samples of one pixel, appended to rays
+    void generate_pixel_rays(int x, int y, std::vector<Ray> &rays);
+
+    // shading of an already intersected ray, visible tells whether its hit point sees the light
+    Vector3 shade(Ray &ray, int depth, bool visible);
+
+    // the batch and its mirror reflections go to the accelerator together, packets with the flat BVH
+    std::vector<Vector3> trace_batch(std::vector<Ray> &rays, int depth);
 
     Vector3
     get_color_phong(Ray &ray, Vector3 hit_point, Vector3 omni_light_position, Vector3 normal, Vector3 v, Vector3 l,
-                    int depth, Material *material);
+                    int depth, Material *material, bool visible);
 
     Vector3 get_color_lambert(Ray &ray, Vector3 normal, Vector3 l, Material *material);
 
     Vector3 get_color_glass(Ray &ray, Vector3 normal, Vector3 v, Vector3 l, int depth, Material *material);
 
     Vector3 get_color_mirror(Ray &ray, Vector3 normal, Vector3 v, Vector3 l, int depth, Material *material);
+
+    Ray make_mirror_ray(Ray &ray, Vector3 normal, Vector3 v);
 };
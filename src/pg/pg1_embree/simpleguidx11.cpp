@@ -84,6 +84,22 @@ Color4f SimpleGuiDX11::get_pixel( const int x, const int y, const float t )
 	return Color4f{ 1.0f, 0.0f, 1.0f, 1.0f };
 }
 
+void SimpleGuiDX11::get_tile( const int x0, const int y0, const int w, const int h, const float t, float * pixels )
+{
+	for ( int y = 0; y < h; ++y )
+	{
+		for ( int x = 0; x < w; ++x )
+		{
+			const Color4f pixel = get_pixel( x0 + x, y0 + y, t );
+			float * data = pixels + ( y * w + x ) * 4;
+			data[0] = pixel.r;
+			data[1] = pixel.g;
+			data[2] = pixel.b;
+			data[3] = pixel.a;
+		}
+	}
+}
+
 void SimpleGuiDX11::Producer()
 {
 	float * local_data = new float[width_*height_ * 4];
@@ -103,22 +119,24 @@ void SimpleGuiDX11::Producer()
 		// compute rendering
 		//std::this_thread::sleep_for( std::chrono::milliseconds( 50 ) );
         std::cout << "Producer started" << std::endl;
+		// tiles instead of pixels, so the renderers can trace the camera rays of a whole tile together
 #pragma omp parallel for collapse(2) schedule(dynamic, 1)
-		for ( int y = 0; y < height_; ++y )
-		{		
-			for ( int x = 0; x < width_; ++x )
-			{				
-				const Color4f pixel = get_pixel( x, y, t );
-				const int offset = ( y * width_ + x ) * 4;
-
-				local_data[offset] = pixel.r;
-				local_data[offset + 1] = pixel.g;
-				local_data[offset + 2] = pixel.b;
-				local_data[offset + 3] = pixel.a;
-                {
-                    memcpy(tex_data_ + offset, local_data + offset, 4 * sizeof(float));
-                }
-            }
+		for ( int tile_y = 0; tile_y < height_; tile_y += TILE_SIZE )
+		{
+			for ( int tile_x = 0; tile_x < width_; tile_x += TILE_SIZE )
+			{
+				const int w = min( TILE_SIZE, width_ - tile_x );
+				const int h = min( TILE_SIZE, height_ - tile_y );
+				float pixels[TILE_SIZE * TILE_SIZE * 4];
+				get_tile( tile_x, tile_y, w, h, t, pixels );
+
+				for ( int y = 0; y < h; ++y )
+				{
+					const int offset = ( ( tile_y + y ) * width_ + tile_x ) * 4;
+					memcpy( local_data + offset, pixels + y * w * 4, w * 4 * sizeof( float ) );
+					memcpy( tex_data_ + offset, local_data + offset, w * 4 * sizeof( float ) );
+				}
+			}
 		}
         //Measure end time
         std::chrono::duration<float> duration = std::chrono::high_resolution_clock::now() - t1;
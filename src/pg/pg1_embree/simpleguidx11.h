@@ -2,6 +2,11 @@
 #include "simpleguidx11.h"
 #include "structs.h"
 
+/*! \def TILE_SIZE
+\brief Width and height of the image tiles the producer hands to get_tile.
+*/
+#define TILE_SIZE 8
+
 class SimpleGuiDX11
 {
 public:	
@@ -25,6 +30,8 @@ protected:
 
 	virtual int Ui();
 	virtual Color4f get_pixel( const int x, const int y, const float t = 0.0f );
+	// pixels of one tile row by row, 4 floats each, the default asks get_pixel for every pixel
+	virtual void get_tile( const int x0, const int y0, const int w, const int h, const float t, float * pixels );
 
 	void Producer();
 
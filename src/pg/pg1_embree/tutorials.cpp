@@ -47,6 +47,9 @@ int tutorial_3( const std::string& file_name, const char * config )
 
     Pathtracer raytracer( 320, 240, deg2rad( 45.0 ),
                          Vector3( 1.5, -1.5, 1 ), Vector3( 0, 0, 0 ), config );
+//    raytracer.SetAccelerator(AcceleratorType::BVH);
+//    raytracer.SetAccelerator(AcceleratorType::BVHAutoTune);
+//    raytracer.SetAccelerator(AcceleratorType::LazyBVH);
     raytracer.LoadScene("data/geosphere_white.obj");
 
     raytracer.LoadBackground();
@@ -160,6 +160,13 @@ public:
         return x;
     }
 
+    float operator[](int i) const {
+        if(i == 0) return x;
+        if(i == 1) return y;
+        if(i == 2) return z;
+        return x;
+    }
+
     Vector3 Reflect(Vector3 normal, bool to_hit_point = false) const;
 
     bool Refract(Vector3 normal, float n1, float n2, Vector3 &result) const;